@@ -0,0 +1,59 @@
+#include <stdlib.h>
+
+#include "buffer_pool.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+#define MIN_SHIFT 12                    // log2(BUFFER_MIN_SIZE)
+#define MAX_SHIFT 26                    // log2(BUFFER_MAX_SIZE)
+#define SIZE_CLASSES (MAX_SHIFT - MIN_SHIFT + 1)
+
+// an idle buffer, the link is kept in the buffer itself
+struct idleBuffer {
+  struct idleBuffer *next;
+};
+
+static struct idleBuffer *idle[SIZE_CLASSES];
+static size_t idleBytes;
+
+// the smallest class that holds size bytes, SIZE_CLASSES if there is none
+static int sizeClass(size_t size){
+  int class = 0;
+  while (class < SIZE_CLASSES && ((size_t) 1 << (MIN_SHIFT + class)) < size){
+    class++;
+  }
+  return class;
+}
+
+char *bufferAcquire(size_t size, size_t *capacity){
+  int class = sizeClass(size);
+  if (class == SIZE_CLASSES){         //too large to keep around
+    *capacity = size;
+    return malloc(size);
+  }
+  *capacity = (size_t) 1 << (MIN_SHIFT + class);
+  struct idleBuffer *buffer = idle[class];
+  if (buffer != NULL){
+    idle[class] = buffer->next;
+    idleBytes -= *capacity;
+    return (char*) buffer;
+  }
+  return malloc(*capacity);
+}
+
+void bufferRelease(char *buffer, size_t capacity){
+  if (buffer == NULL){
+    return;
+  }
+  int class = sizeClass(capacity);
+  if (class == SIZE_CLASSES || ((size_t) 1 << (MIN_SHIFT + class)) != capacity || idleBytes + capacity > BUFFER_POOL_MAX_IDLE){
+    free(buffer);
+    return;
+  }
+  struct idleBuffer *released = (struct idleBuffer*) buffer;
+  released->next = idle[class];
+  idle[class] = released;
+  idleBytes += capacity;
+}
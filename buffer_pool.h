@@ -0,0 +1,33 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* Reusable key/text buffers for a server worker (the event loop process, a prefork worker or a
+* forked child), so serving requests doesn't keep going back to malloc.
+*
+* Buffers come in power of two size classes from BUFFER_MIN_SIZE to BUFFER_MAX_SIZE. A released
+* buffer waits on the free list of its class for the next request that needs that much, as long
+* as the pool holds no more than BUFFER_POOL_MAX_IDLE idle bytes, otherwise it is freed. Larger
+* buffers are allocated for one request and freed right after it. So a worker's memory is what its
+* requests in flight need plus at most BUFFER_POOL_MAX_IDLE.
+*
+* Not thread safe: only the thread running the connections uses it.
+*/
+
+#define BUFFER_MIN_SIZE (4 * 1024)
+#define BUFFER_MAX_SIZE (64 * 1024 * 1024)
+#define BUFFER_POOL_MAX_IDLE (256 * 1024 * 1024)
+
+// a buffer of at least size bytes, *capacity is set to its real size; NULL if there is no memory
+char *bufferAcquire(size_t size, size_t *capacity);
+
+// hand a buffer from bufferAcquire back with the capacity it came with (NULL is ignored)
+void bufferRelease(char *buffer, size_t capacity);
+
+#endif
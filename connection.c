@@ -0,0 +1,1034 @@
+#define _GNU_SOURCE             // MSG_CMSG_CLOEXEC, F_GET_SEALS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "connection.h"
+#include "otp_kernel.h"
+#include "thread_pool.h"
+#include "buffer_pool.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+// The clients send every length as sizeof(char*) bytes of a NUL padded decimal string and
+// always transmit key/text in whole 1k chunks (the last chunk is padded), so the server has
+// to consume exactly that many bytes to stay in sync with them.
+#define LEGACY_LENGTH_FIELD 8
+#define LEGACY_CHUNK 1000
+
+#define MAX_BUFFERED_MESSAGE (1ULL << 32)     // largest key/text a binary request may make us hold in memory
+#define FRAGMENT_SIZE (64 * 1024)             // multiplexed results are sent in fragments of this size
+#define PACKED_FRAGMENT_SIZE (FRAGMENT_SIZE / 3 * 3)    // packed fragments end on whole groups
+#define PARALLEL_CHUNK (256 * 1024)           // piece of a large text transformed by one thread at a time (fits in L2)
+#define MAX_STREAM_BATCH (32 * 1024 * 1024)   // most chars of a stream held for one parallel transform
+#define MAX_IDLE_REQUESTS 256                 // finished request structs kept for reuse by this worker
+#define MAX_IDLE_CONNECTIONS 1024             // closed connection structs kept for reuse by this worker
+
+static char const zeroPadding[LEGACY_CHUNK];     //NUL bytes used to pad the result to whole 1k chunks
+
+// started by the first text above the threshold, in the process that serves it (threads don't survive a fork)
+static struct threadPool *transformPool;
+
+// Structs of finished requests and closed connections, reused by the next ones. Their buffers go
+// back to the worker's buffer pool, so once a worker has warmed up it serves without malloc/free.
+static struct pendingRequest *idleRequests;
+static int idleRequestCount;
+static struct connection *idleConnections;
+static int idleConnectionCount;
+static uint32_t lastTraceId;
+
+// round a length up to whole 1k chunks, the way the clients send it
+static size_t paddedLength(size_t length){
+  return (length + LEGACY_CHUNK - 1) / LEGACY_CHUNK * LEGACY_CHUNK;
+}
+
+// the operation a binary request (by its magic) or an old client (by its test message) asks for, NULL if the service doesn't offer it
+static const struct otpOperation *findOperation(const struct otpService *service, uint32_t magic, char handshake){
+  for (int i = 0; i < service->operationCount; i++){
+    if ((magic != 0 && service->operations[i]->magic == magic) || (handshake != 0 && service->operations[i]->handshake == handshake)){
+      return service->operations[i];
+    }
+  }
+  return NULL;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// requests
+
+static struct pendingRequest *requestAcquire(struct connection *conn){
+  struct pendingRequest *request = idleRequests;
+  if (request != NULL){
+    idleRequests = request->next;
+    idleRequestCount--;
+  } else if ((request = malloc(sizeof(struct pendingRequest))) == NULL){
+    return NULL;
+  }
+  memset(request, '\0', sizeof(*request));
+  request->operation = conn->operation;
+  request->status = OTP_STATUS_OK;
+  return request;
+}
+
+// the request is done with: its buffers go back to the pool, the struct is kept for the next request
+static void requestRelease(struct pendingRequest *request){
+  bufferRelease(request->keyBuffer, request->keyCapacity);
+  bufferRelease(request->textBuffer, request->textCapacity);
+  if (idleRequestCount < MAX_IDLE_REQUESTS){
+    request->next = idleRequests;
+    idleRequests = request;
+    idleRequestCount++;
+  } else {
+    free(request);
+  }
+}
+
+// make sure a request buffer holds at least size bytes (what it held before is not kept)
+static int growBuffer(char **buffer, size_t *capacity, size_t size){
+  if (*capacity >= size){
+    return 0;
+  }
+  bufferRelease(*buffer, *capacity);
+  *capacity = 0;
+  if ((*buffer = bufferAcquire(size, capacity)) == NULL){
+    return -1;
+  }
+  return 0;
+}
+
+// add a finished request to the results waiting to be sent
+static void queueResponse(struct connection *conn, struct pendingRequest *request){
+  if (request->readyAt == 0){       //not a fragment that goes back in line
+    request->readyAt = metricsClock(conn->service->metrics);
+  }
+  request->next = NULL;
+  if (conn->responseTail != NULL){
+    conn->responseTail->next = request;
+  } else {
+    conn->responseHead = request;
+  }
+  conn->responseTail = request;
+  conn->responseCount++;
+}
+
+static struct pendingRequest *popResponse(struct connection *conn){
+  struct pendingRequest *request = conn->responseHead;
+  conn->responseHead = request->next;
+  if (conn->responseHead == NULL){
+    conn->responseTail = NULL;
+  }
+  conn->responseCount--;
+  request->next = NULL;
+  return request;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// output
+
+// queue a short reply (it gets copied into the connection)
+static void queueReply(struct connection *conn, const char *data, size_t length){
+  char *start = conn->outSmall + conn->outSmallLength;
+  memcpy(start, data, length);
+  conn->outSmallLength += length;
+  if (conn->outCount > 0 && (char*) conn->out[conn->outCount - 1].iov_base + conn->out[conn->outCount - 1].iov_len == start){
+    conn->out[conn->outCount - 1].iov_len += length;     //extend the previous reply
+    return;
+  }
+  conn->out[conn->outCount].iov_base = start;
+  conn->out[conn->outCount].iov_len = length;
+  conn->outCount++;
+}
+
+// queue a buffer that stays owned by the connection until it is sent (no copy)
+static void queueData(struct connection *conn, const char *data, size_t length){
+  if (length == 0){
+    return;
+  }
+  conn->out[conn->outCount].iov_base = (char*) data;
+  conn->out[conn->outCount].iov_len = length;
+  conn->outCount++;
+}
+
+// queue a binary response header for `length` result bytes starting at `offset`
+static void queueFrameHeader(struct connection *conn, const struct pendingRequest *request, int flags,
+                             uint64_t offset, uint64_t length){
+  struct otpHeader response;
+  unsigned char encoded[OTP_HEADER_SIZE];
+  memset(&response, '\0', sizeof(response));
+  response.magic = OTP_MAGIC_RESULT;
+  response.version = OTP_PROTOCOL_VERSION;
+  response.flags = flags;
+  response.status = request->status;
+  response.requestId = request->header.requestId;
+  response.keyLength = offset;
+  response.textLength = length;
+  otpEncodeHeader(&response, encoded);
+  queueReply(conn, (char*) encoded, OTP_HEADER_SIZE);
+}
+
+// Turn waiting results into response frames. Multiplexed results take turns, one fragment
+// each, so a small result never waits for a large one to finish. The others are sent whole
+// and in the order their requests came in. A chunk (or batch of chunks) of a streamed result
+// is a fragment of its own, at the offset it has in the whole result.
+static void fillOutput(struct connection *conn){
+  int frames = 0;
+  int sentInOrder = 0;
+  for (int turns = conn->responseCount; turns > 0 && frames < MAX_FRAMES_PER_WRITE; turns--){
+    struct pendingRequest *request = conn->responseHead;
+    int multiplexed = (request->header.flags & OTP_FLAG_MULTIPLEX) != 0;
+    if (!multiplexed && sentInOrder){      //only one in-order result per pass, the next one waits its turn
+      break;
+    }
+    popResponse(conn);
+    if (request->announcePad){      //tell the client which pad segment was used before the result
+      queueFrameHeader(conn, request, OTP_FLAG_PAD | OTP_FLAG_MORE | OTP_FLAG_KEEPALIVE, request->padOffset, 0);
+      request->announcePad = 0;
+      frames++;
+    }
+    size_t remaining = request->textLength - request->sent;
+    size_t fragmentSize = (request->header.flags & OTP_FLAG_PACKED) ? PACKED_FRAGMENT_SIZE : FRAGMENT_SIZE;
+    int shared = (request->header.flags & OTP_FLAG_SHARED) != 0;       //the result is already in the client's region, one frame tells it
+    //a batch of stream chunks goes whole, a later (shorter) batch must not overtake its last fragment
+    int streamed = (request->header.flags & OTP_FLAG_STREAM) != 0;
+    size_t fragment = multiplexed && !shared && !streamed && remaining > fragmentSize ? fragmentSize : remaining;
+    int last = fragment == remaining;
+    //every frame but the very last one on the connection tells the client that more will follow
+    int final = last && !request->more && conn->state == STATE_DRAIN && conn->responseHead == NULL;
+    int flags = (last && !request->more ? 0 : OTP_FLAG_MORE) | (final ? 0 : OTP_FLAG_KEEPALIVE)
+                | (request->header.flags & (OTP_FLAG_PACKED | OTP_FLAG_SHARED));
+    queueFrameHeader(conn, request, flags, request->offset + request->sent, fragment);
+    if (!shared){
+      queueData(conn, request->textBuffer + otpWireLength(&request->header, request->sent), otpWireLength(&request->header, fragment));
+    }
+    request->sent += fragment;
+    frames++;
+    sentInOrder |= !multiplexed;
+    if (last){      //its buffers are in use until the output has been written
+      request->next = conn->retiring;
+      conn->retiring = request;
+    } else {
+      queueResponse(conn, request);
+    }
+  }
+}
+
+// send the queued output, returns 1 when everything is sent, 0 if the socket is full, -1 on error
+static int flushOutput(struct connection *conn){
+  while (conn->outCount > 0){
+    struct msghdr message;
+    memset(&message, '\0', sizeof(message));
+    message.msg_iov = conn->out;
+    message.msg_iovlen = conn->outCount;
+    ssize_t charsWritten = sendmsg(conn->fd, &message, MSG_NOSIGNAL);
+    if (charsWritten < 0){
+      if (errno == EAGAIN || errno == EWOULDBLOCK){
+        return 0;
+      }
+      if (errno == EINTR){
+        continue;
+      }
+      return -1;
+    }
+    metricsAdd(conn->service->metrics, METRIC_BYTES_OUT, charsWritten);
+    //drop everything that has been written from the front of the queue
+    int first = 0;
+    while (first < conn->outCount && (size_t) charsWritten >= conn->out[first].iov_len){
+      charsWritten -= conn->out[first].iov_len;
+      first++;
+    }
+    if (first < conn->outCount){
+      conn->out[first].iov_base = (char*) conn->out[first].iov_base + charsWritten;
+      conn->out[first].iov_len -= charsWritten;
+    }
+    memmove(conn->out, conn->out + first, (conn->outCount - first) * sizeof(struct iovec));
+    conn->outCount -= first;
+    if (conn->outCount > 0){
+      metricsAdd(conn->service->metrics, METRIC_SHORT_WRITES, 1);
+    }
+  }
+  conn->outSmallLength = 0;
+  //every result that was queued has left, their buffers are free again
+  while (conn->retiring != NULL){
+    struct pendingRequest *request = conn->retiring;
+    conn->retiring = request->next;
+    metricsRecordPhase(conn->service->metrics, PHASE_SEND, request->readyAt);
+    traceRecord(conn->service->trace, TRACE_SENT, conn->traceId, request->textLength);
+    requestRelease(request);
+  }
+  return 1;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// input
+
+// keep a descriptor the client passed with SCM_RIGHTS (the region it shares), replacing an earlier one
+static void keepPassedFD(struct connection *conn, struct msghdr *message){
+  for (struct cmsghdr *control = CMSG_FIRSTHDR(message); control != NULL; control = CMSG_NXTHDR(message, control)){
+    if (control->cmsg_level == SOL_SOCKET && control->cmsg_type == SCM_RIGHTS && control->cmsg_len == CMSG_LEN(sizeof(int))){
+      if (conn->passedFD >= 0){
+        close(conn->passedFD);
+      }
+      memcpy(&conn->passedFD, CMSG_DATA(control), sizeof(int));
+    }
+  }
+}
+
+// read until the current state has all of its expected bytes, returns 1 when complete, 0 if the socket is empty, -1 on error/EOF
+static int receiveExpected(struct connection *conn, char *destination){
+  while (conn->filled < conn->expected){
+    //recvmsg: on a Unix socket a descriptor may come along with the bytes
+    struct iovec vector = { destination + conn->filled, conn->expected - conn->filled };
+    union {
+      struct cmsghdr align;
+      char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr message;
+    memset(&message, '\0', sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+    ssize_t charsRead = recvmsg(conn->fd, &message, MSG_CMSG_CLOEXEC);
+    if (charsRead > 0 && message.msg_controllen > 0){
+      keepPassedFD(conn, &message);
+    }
+    if (charsRead < 0){
+      if (errno == EAGAIN || errno == EWOULDBLOCK){
+        return 0;
+      }
+      if (errno == EINTR){
+        continue;
+      }
+      return -1;
+    }
+    if (charsRead == 0){     //client went away in the middle of a message
+      return -1;
+    }
+    metricsAdd(conn->service->metrics, METRIC_BYTES_IN, charsRead);
+    if ((size_t) charsRead < vector.iov_len){
+      metricsAdd(conn->service->metrics, METRIC_SHORT_READS, 1);
+    }
+    conn->filled += charsRead;
+  }
+  return 1;
+}
+
+// read and throw away the rest of the expected bytes, same return values as receiveExpected
+static int discardExpected(struct connection *conn){
+  char discard[4096];
+  while (conn->filled < conn->expected){
+    size_t want = conn->expected - conn->filled;
+    ssize_t charsRead = recv(conn->fd, discard, want < sizeof(discard) ? want : sizeof(discard), 0);
+    if (charsRead < 0){
+      if (errno == EAGAIN || errno == EWOULDBLOCK){
+        return 0;
+      }
+      if (errno == EINTR){
+        continue;
+      }
+      return -1;
+    }
+    if (charsRead == 0){
+      return -1;
+    }
+    metricsAdd(conn->service->metrics, METRIC_BYTES_IN, charsRead);
+    conn->filled += charsRead;
+  }
+  return 1;
+}
+
+// move to the next state, which expects `expected` bytes
+static void expect(struct connection *conn, enum connectionState state, size_t expected){
+  conn->state = state;
+  conn->expected = expected;
+  conn->filled = 0;
+}
+
+// parse a received length field, returns -1 if it is not a number
+static long parseLengthField(struct connection *conn){
+  conn->lengthField[LEGACY_LENGTH_FIELD] = '\0';
+  char *end = NULL;
+  errno = 0;
+  long length = strtol(conn->lengthField, &end, 10);
+  if (end == conn->lengthField || errno != 0 || length < 0 || length > INT_MAX){
+    return -1;
+  }
+  return length;
+}
+
+// Answer a binary request with an error (or a request that has no result, like sharing a region). If its
+// body can be skipped the connection goes on with the next request, otherwise we stop reading requests from this connection.
+static int rejectRequest(struct connection *conn, int status, int skipBody){
+  struct pendingRequest *request = conn->receiving != NULL ? conn->receiving : requestAcquire(conn);
+  conn->receiving = NULL;
+  if (request == NULL){
+    return -1;
+  }
+  memcpy(&request->header, &conn->request, sizeof(request->header));
+  request->status = status;
+  request->textLength = 0;
+  if (status != OTP_STATUS_OK){
+    metricsAdd(conn->service->metrics, METRIC_REQUESTS_REFUSED, 1);
+  }
+  queueResponse(conn, request);
+  if (skipBody && (conn->request.flags & OTP_FLAG_KEEPALIVE)){
+    expect(conn, STATE_SKIP_BODY, otpRequestBodyLength(&conn->request));
+  } else {
+    expect(conn, STATE_DRAIN, 0);
+  }
+  return 1;
+}
+
+// find the pad segment a request uses as its key (encryption consumes it), returns the status for the response
+static int acceptPad(struct connection *conn){
+  const struct otpHeader *header = &conn->request;
+  struct padStore *pads = conn->service->pads;
+  uint64_t offset = header->keyLength;
+  if (padKey(pads, header->padId, 0, 0) == NULL){
+    return OTP_STATUS_NO_SUCH_PAD;
+  }
+  if (offset == OTP_PAD_OFFSET_ANY){
+    if (!conn->operation->consumesPads){      //decryption has to use the segment the text was encrypted with
+      return OTP_STATUS_BAD_REQUEST;
+    }
+  } else if (padKey(pads, header->padId, offset, header->textLength) == NULL){
+    return OTP_STATUS_NO_SUCH_PAD;
+  }
+  if (conn->operation->consumesPads && padConsume(pads, header->padId, &offset, header->textLength) < 0){
+    return OTP_STATUS_PAD_USED;
+  }
+  conn->padKey = padKey(pads, header->padId, offset, header->textLength);
+  conn->padOffset = offset;
+  return OTP_STATUS_OK;
+}
+
+// map the region the client passed along with the request, returns the status for the response
+static int attachRegion(struct connection *conn){
+  struct stat info;
+  int fd = conn->passedFD;
+  conn->passedFD = -1;
+  if (fd < 0){            //TCP, or the client forgot the descriptor
+    return OTP_STATUS_UNSUPPORTED;
+  }
+  //a region the client could shrink under us would crash the worker (SIGBUS), it has to be sealed
+  int seals = fcntl(fd, F_GET_SEALS);
+  if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &info) < 0 || info.st_size <= 0){
+    close(fd);
+    return OTP_STATUS_UNSUPPORTED;
+  }
+  char *region = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (region == MAP_FAILED){
+    return OTP_STATUS_TOO_LARGE;
+  }
+  if (conn->region != NULL){
+    munmap(conn->region, conn->regionSize);
+  }
+  conn->region = region;
+  conn->regionSize = info.st_size;
+  return OTP_STATUS_OK;
+}
+
+// a shared request: share the region, or read where key and text are in it, returns 1 to go on reading
+static int acceptShared(struct connection *conn){
+  const struct otpHeader *header = &conn->request;
+  int padded = (header->flags & OTP_FLAG_PAD) != 0;
+  int status;
+  if (header->flags & (OTP_FLAG_STREAM | OTP_FLAG_PACKED)){     //nothing to stream or pack, nothing is sent
+    return rejectRequest(conn, OTP_STATUS_BAD_REQUEST, 1);
+  }
+  if (header->textLength == 0){
+    return rejectRequest(conn, attachRegion(conn), 1);
+  }
+  if (conn->region == NULL){
+    return rejectRequest(conn, OTP_STATUS_BAD_REQUEST, 1);
+  }
+  if (padded && (status = acceptPad(conn)) != OTP_STATUS_OK){
+    return rejectRequest(conn, status, 1);
+  }
+  if (!padded && header->keyLength < header->textLength){
+    return rejectRequest(conn, OTP_STATUS_KEY_TOO_SHORT, 1);
+  }
+  struct pendingRequest *request = requestAcquire(conn);
+  if ((conn->receiving = request) == NULL){
+    return -1;
+  }
+  memcpy(&request->header, header, sizeof(request->header));
+  request->textLength = header->textLength;
+  if (padded){
+    request->key = conn->padKey;
+    request->announcePad = 1;
+    request->padOffset = conn->padOffset;
+  }
+  expect(conn, STATE_SHARED_BODY, OTP_SHARED_BODY_SIZE);
+  return 1;
+}
+
+// check a received binary request header and allocate its buffers, returns 1 to go on reading the body
+static int acceptHeader(struct connection *conn){
+  struct otpHeader *header = &conn->request;
+  if (otpDecodeHeader(conn->headerBuffer, header) < 0){
+    return rejectRequest(conn, OTP_STATUS_BAD_REQUEST, 0);
+  }
+  traceRecord(conn->service->trace, TRACE_LENGTH, conn->traceId, header->textLength);
+  if ((conn->operation = findOperation(conn->service, header->magic, 0)) == NULL){     //e.g. enc_client connected to dec_server
+    metricsAdd(conn->service->metrics, METRIC_HANDSHAKE_FAILURES, 1);
+    return rejectRequest(conn, header->magic == OTP_MAGIC_ENCRYPT || header->magic == OTP_MAGIC_DECRYPT
+                               ? OTP_STATUS_WRONG_SERVER : OTP_STATUS_BAD_REQUEST, 0);
+  }
+  if (header->version != OTP_PROTOCOL_VERSION){
+    metricsAdd(conn->service->metrics, METRIC_HANDSHAKE_FAILURES, 1);
+    return rejectRequest(conn, OTP_STATUS_BAD_VERSION, 0);
+  }
+  if ((header->flags & OTP_FLAG_SHARED) && !(header->flags & ~OTP_FLAGS_SUPPORTED)){      //nothing to buffer, the text is in the region
+    return acceptShared(conn);
+  }
+  int streamed = (header->flags & OTP_FLAG_STREAM) != 0;
+  int padded = (header->flags & OTP_FLAG_PAD) != 0;
+  uint64_t buffered = padded ? header->textLength : header->keyLength;
+  if (buffered > MAX_BUFFERED_MESSAGE && !streamed){     //a stream never has more than a window in memory
+    return rejectRequest(conn, OTP_STATUS_TOO_LARGE, 0);
+  }
+  if ((header->flags & ~OTP_FLAGS_SUPPORTED) != 0){   //the client may retry without them on the same connection
+    return rejectRequest(conn, OTP_STATUS_UNSUPPORTED, 1);
+  }
+  int status;
+  if (padded && (status = acceptPad(conn)) != OTP_STATUS_OK){
+    return rejectRequest(conn, status, 1);
+  }
+  if (!padded && header->keyLength < header->textLength){        //the key has to cover the whole text
+    return rejectRequest(conn, OTP_STATUS_KEY_TOO_SHORT, 1);
+  }
+  if (streamed){
+    if (!padded && header->keyLength != header->textLength){     //the chunks pair every text byte with one key byte
+      return rejectRequest(conn, OTP_STATUS_BAD_REQUEST, 1);
+    }
+    conn->streamed = 0;
+    expect(conn, STATE_STREAM_KEY, 0);
+    return 1;
+  }
+  //packed: a pad segment gets converted into symbols in the key buffer
+  int packed = (header->flags & OTP_FLAG_PACKED) != 0;
+  struct pendingRequest *request = requestAcquire(conn);
+  conn->receiving = request;
+  if (request == NULL
+      || (!padded && growBuffer(&request->keyBuffer, &request->keyCapacity, header->keyLength + 1) < 0)
+      || (padded && packed && growBuffer(&request->keyBuffer, &request->keyCapacity, header->textLength + 1) < 0)
+      || growBuffer(&request->textBuffer, &request->textCapacity, header->textLength + 1) < 0){
+    return rejectRequest(conn, OTP_STATUS_TOO_LARGE, 1);
+  }
+  memcpy(&request->header, header, sizeof(request->header));
+  request->textLength = header->textLength;
+  if (padded){            //no key on the wire, the text follows the header
+    request->key = conn->padKey;
+    request->announcePad = 1;
+    request->padOffset = conn->padOffset;
+    conn->phaseStart = metricsClock(conn->service->metrics);
+    expect(conn, STATE_BODY_TEXT, otpWireLength(header, request->textLength));
+    return 1;
+  }
+  conn->phaseStart = metricsClock(conn->service->metrics);
+  request->key = request->keyBuffer;
+  request->keyLength = header->keyLength;
+  expect(conn, STATE_BODY_KEY, otpWireLength(header, request->keyLength));
+  return 1;
+}
+
+// the request is done: go on with the next one or stop reading
+static int finishRequest(struct connection *conn, const struct pendingRequest *request){
+  conn->requestsServed++;
+  metricsAdd(conn->service->metrics, METRIC_REQUESTS, 1);
+  if ((request->header.flags & OTP_FLAG_KEEPALIVE)
+      && (conn->service->maxRequests == 0 || conn->requestsServed < conn->service->maxRequests)){
+    expect(conn, STATE_HEADER, OTP_HEADER_SIZE);
+  } else {      //a pipelining client may already be sending more requests, closing on them would reset the connection and lose the results
+    expect(conn, STATE_DRAIN, 0);
+  }
+  return 1;
+}
+
+// a large text being transformed piece by piece on the pool
+struct parallelTransform {
+  transformFunction transform;
+  char *text;
+  const char *key;
+  size_t length;
+};
+
+static void transformPiece(void *context, size_t index){
+  struct parallelTransform *job = context;
+  size_t offset = index * PARALLEL_CHUNK;
+  size_t length = job->length - offset < PARALLEL_CHUNK ? job->length - offset : PARALLEL_CHUNK;
+  job->transform(job->text + offset, job->key + offset, length);
+}
+
+// transform a text in place, in parallel pieces if it is large enough (every piece lands where it was, so the result is in order)
+static void runTransform(const struct otpService *service, transformFunction transform, char *text, const char *key, size_t length){
+  if (service->parallelThreshold == 0 || length < service->parallelThreshold || service->transformThreads < 2
+      || (transformPool == NULL && (transformPool = threadPoolCreate(service->transformThreads)) == NULL)){
+    transform(text, key, length);
+    return;
+  }
+  struct parallelTransform job = { transform, text, key, length };
+  threadPoolRun(transformPool, (length + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK, transformPiece, &job);
+}
+
+// Transform the text of a request (or chunk) in place. Packed ones are unpacked into symbols,
+// transformed as symbols and packed again, the key only needs as many symbols as the text.
+static void transformRequest(struct connection *conn, struct pendingRequest *request){
+  uint64_t started = metricsClock(conn->service->metrics);
+  if (!(request->header.flags & OTP_FLAG_PACKED)){
+    runTransform(conn->service, request->operation->transform, request->textBuffer, request->key, request->textLength);
+  } else {
+    if (request->key == request->keyBuffer){
+      otpUnpack(request->keyBuffer, request->textLength);
+    } else {          //a pad keeps characters
+      otpTextToSymbols(request->keyBuffer, request->key, request->textLength);
+    }
+    otpUnpack(request->textBuffer, request->textLength);
+    runTransform(conn->service, request->operation->transformSymbols, request->textBuffer, request->keyBuffer, request->textLength);
+    otpPack(request->textBuffer, request->textLength);
+  }
+  metricsRecordPhase(conn->service->metrics, PHASE_TRANSFORM, started);
+  traceRecord(conn->service->trace, TRACE_TRANSFORM, conn->traceId, request->textLength);
+}
+
+// the whole text of a binary request is here: transform it and queue the result
+static int completeRequest(struct connection *conn){
+  struct pendingRequest *request = conn->receiving;
+  conn->receiving = NULL;
+  transformRequest(conn, request);
+  queueResponse(conn, request);
+  return finishRequest(conn, request);
+}
+
+// the offsets of a shared request are here: transform the text where it is in the region
+static int completeSharedRequest(struct connection *conn){
+  struct pendingRequest *request = conn->receiving;
+  conn->receiving = NULL;
+  uint64_t keyOffset, textOffset;
+  otpDecodeSharedBody(conn->sharedBody, &keyOffset, &textOffset);
+  size_t length = request->textLength;
+  int keyInside = request->key != NULL || (keyOffset <= conn->regionSize && length <= conn->regionSize - keyOffset);
+  if (!keyInside || textOffset > conn->regionSize || length > conn->regionSize - textOffset){
+    request->status = OTP_STATUS_BAD_REQUEST;
+    request->textLength = 0;
+    metricsAdd(conn->service->metrics, METRIC_REQUESTS_REFUSED, 1);
+  } else {
+    const char *key = request->key != NULL ? request->key : conn->region + keyOffset;
+    uint64_t started = metricsClock(conn->service->metrics);
+    runTransform(conn->service, request->operation->transform, conn->region + textOffset, key, length);
+    metricsRecordPhase(conn->service->metrics, PHASE_TRANSFORM, started);
+    traceRecord(conn->service->trace, TRACE_TRANSFORM, conn->traceId, length);
+  }
+  queueResponse(conn, request);
+  return finishRequest(conn, request);
+}
+
+// Chars of a stream transformed at once: a chunk, or as many whole chunks as make the parallel
+// threshold when the stream is at least that long, so a large streamed message still goes to the pool.
+static size_t streamBatch(const struct connection *conn, size_t chunk){
+  size_t threshold = conn->service->parallelThreshold;
+  if (threshold == 0 || conn->service->transformThreads < 2 || conn->request.textLength < threshold
+      || threshold > MAX_STREAM_BATCH){
+    return chunk;
+  }
+  return (threshold + chunk - 1) / chunk * chunk;
+}
+
+// chars of the next chunk of the batch being received
+static size_t nextChunkLength(const struct connection *conn){
+  size_t chunk = (conn->request.flags & OTP_FLAG_PACKED) ? OTP_PACKED_STREAM_CHUNK : OTP_STREAM_CHUNK;
+  size_t left = conn->receiving->textLength - conn->batchFilled;
+  return left < chunk ? left : chunk;
+}
+
+// start reading the key bytes of the next chunk (none with a pad)
+static void expectStreamKey(struct connection *conn){
+  expect(conn, STATE_STREAM_KEY, (conn->request.flags & OTP_FLAG_PAD) ? 0 : otpWireLength(&conn->request, nextChunkLength(conn)));
+}
+
+// get buffers for the next batch of chunks of a streamed request and start reading the key bytes of its first chunk
+static int startStreamChunk(struct connection *conn){
+  int packed = (conn->request.flags & OTP_FLAG_PACKED) != 0;
+  uint64_t remaining = conn->request.textLength - conn->streamed;
+  size_t batch = streamBatch(conn, packed ? OTP_PACKED_STREAM_CHUNK : OTP_STREAM_CHUNK);
+  size_t length = remaining < batch ? remaining : batch;
+  int padded = (conn->request.flags & OTP_FLAG_PAD) != 0;
+  struct pendingRequest *request = requestAcquire(conn);
+  conn->receiving = request;
+  if (request == NULL
+      || ((!padded || packed) && growBuffer(&request->keyBuffer, &request->keyCapacity, batch + 1) < 0)
+      || growBuffer(&request->textBuffer, &request->textCapacity, batch + 1) < 0){
+    return -1;
+  }
+  memcpy(&request->header, &conn->request, sizeof(request->header));
+  request->textLength = length;
+  request->offset = conn->streamed;
+  request->more = length < remaining;
+  conn->batchFilled = 0;
+  conn->phaseStart = metricsClock(conn->service->metrics);
+  if (padded){
+    request->key = conn->padKey + conn->streamed;
+    request->announcePad = conn->streamed == 0;
+    request->padOffset = conn->padOffset;
+  } else {
+    request->key = request->keyBuffer;
+    request->keyLength = length;
+  }
+  expectStreamKey(conn);
+  return 1;
+}
+
+// every chunk of a batch is here: transform it and send it back right away
+static int completeStreamChunk(struct connection *conn){
+  struct pendingRequest *request = conn->receiving;
+  conn->receiving = NULL;
+  transformRequest(conn, request);
+  conn->streamed += request->textLength;
+  queueResponse(conn, request);
+  if (request->more){
+    expect(conn, STATE_STREAM_KEY, 0);
+    return 1;
+  }
+  return finishRequest(conn, request);
+}
+
+// throw away whatever the client still sends after the last response, returns 0 while it keeps the connection open, -1 once it is gone
+static int drainInput(struct connection *conn){
+  char discard[4096];
+  if (conn->filled == 0){       //first time here: tell the client we are done talking
+    shutdown(conn->fd, SHUT_WR);
+    conn->filled = 1;
+  }
+  while (1){
+    ssize_t charsRead = recv(conn->fd, discard, sizeof(discard), 0);
+    if (charsRead > 0){
+      metricsAdd(conn->service->metrics, METRIC_BYTES_IN, charsRead);
+      continue;
+    }
+    if (charsRead < 0 && errno == EINTR){
+      continue;
+    }
+    return (charsRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : -1;
+  }
+}
+
+// allocate the legacy key/text buffer, large enough for the padding the client sends
+static char *legacyBuffer(char **buffer, size_t *capacity, size_t length){
+  if (growBuffer(buffer, capacity, paddedLength(length) + 1) < 0){
+    return NULL;
+  }
+  (*buffer)[length] = '\0';
+  return *buffer;
+}
+
+// advance the state machine with whatever the socket has, returns 1 on progress, 0 if it has to wait, -1 to close
+static int step(struct connection *conn){
+  int status;
+  long length;
+  char testBuffer[2];
+  struct pendingRequest *request = conn->receiving;
+
+  switch (conn->state){
+    case STATE_HANDSHAKE:       //first test message 't' (enc) or 'p' (dec), or the first byte of a binary header
+      if ((status = receiveExpected(conn, testBuffer)) <= 0){
+        return status;
+      }
+      traceRecord(conn->service->trace, TRACE_HANDSHAKE, conn->traceId, (unsigned char) testBuffer[0]);
+      if (testBuffer[0] == OTP_MAGIC_FIRST_BYTE){       //the handshake ends with the first header
+        conn->headerBuffer[0] = testBuffer[0];
+        expect(conn, STATE_HEADER, OTP_HEADER_SIZE);
+        conn->filled = 1;
+        return 1;
+      }
+      if ((conn->operation = findOperation(conn->service, 0, testBuffer[0])) == NULL){     //not our client, send the indication of fail and hang up
+        metricsAdd(conn->service->metrics, METRIC_HANDSHAKE_FAILURES, 1);
+        queueReply(conn, "f", 1);
+        expect(conn, STATE_CLOSING, 0);
+        return 1;
+      }
+      queueReply(conn, &conn->operation->handshake, 1);     //send a success message back to the client
+      metricsRecordPhase(conn->service->metrics, PHASE_HANDSHAKE, conn->phaseStart);
+      conn->phaseStart = metricsClock(conn->service->metrics);
+      expect(conn, STATE_KEY_LENGTH, LEGACY_LENGTH_FIELD);
+      return 1;
+
+    case STATE_HEADER:
+      if ((status = receiveExpected(conn, (char*) conn->headerBuffer)) <= 0){
+        return status;
+      }
+      if (!conn->greeted){
+        metricsRecordPhase(conn->service->metrics, PHASE_HANDSHAKE, conn->phaseStart);
+        conn->greeted = 1;
+      }
+      return acceptHeader(conn);
+
+    case STATE_BODY_KEY:
+      if ((status = receiveExpected(conn, request->keyBuffer)) <= 0){
+        return status;
+      }
+      metricsRecordPhase(conn->service->metrics, PHASE_KEY, conn->phaseStart);
+      traceRecord(conn->service->trace, TRACE_KEY, conn->traceId, request->keyLength);
+      conn->phaseStart = metricsClock(conn->service->metrics);
+      expect(conn, STATE_BODY_TEXT, otpWireLength(&request->header, request->textLength));
+      return 1;
+
+    case STATE_BODY_TEXT:
+      if ((status = receiveExpected(conn, request->textBuffer)) <= 0){
+        return status;
+      }
+      metricsRecordPhase(conn->service->metrics, PHASE_TEXT, conn->phaseStart);
+      traceRecord(conn->service->trace, TRACE_TEXT, conn->traceId, request->textLength);
+      //answer with the result right away, no acknowledgements needed
+      return completeRequest(conn);
+
+    case STATE_STREAM_KEY:
+      if (request == NULL && startStreamChunk(conn) < 0){
+        return -1;
+      }
+      request = conn->receiving;
+      if (request->key == request->keyBuffer){       //not a pad, the chunk goes after the ones already in the batch
+        if ((status = receiveExpected(conn, request->keyBuffer + otpWireLength(&conn->request, conn->batchFilled))) <= 0){
+          return status;
+        }
+        metricsRecordPhase(conn->service->metrics, PHASE_KEY, conn->phaseStart);
+        traceRecord(conn->service->trace, TRACE_KEY, conn->traceId, nextChunkLength(conn));
+        conn->phaseStart = metricsClock(conn->service->metrics);
+      }
+      expect(conn, STATE_STREAM_TEXT, otpWireLength(&conn->request, nextChunkLength(conn)));
+      return 1;
+
+    case STATE_STREAM_TEXT:
+      if ((status = receiveExpected(conn, request->textBuffer + otpWireLength(&conn->request, conn->batchFilled))) <= 0){
+        return status;
+      }
+      length = nextChunkLength(conn);
+      metricsRecordPhase(conn->service->metrics, PHASE_TEXT, conn->phaseStart);
+      traceRecord(conn->service->trace, TRACE_TEXT, conn->traceId, length);
+      conn->batchFilled += length;
+      if (conn->batchFilled < request->textLength){      //the next chunk of the same batch
+        conn->phaseStart = metricsClock(conn->service->metrics);
+        expectStreamKey(conn);
+        return 1;
+      }
+      return completeStreamChunk(conn);
+
+    case STATE_SHARED_BODY:
+      if ((status = receiveExpected(conn, (char*) conn->sharedBody)) <= 0){
+        return status;
+      }
+      return completeSharedRequest(conn);
+
+    case STATE_SKIP_BODY:
+      if ((status = discardExpected(conn)) <= 0){
+        return status;
+      }
+      expect(conn, STATE_HEADER, OTP_HEADER_SIZE);
+      return 1;
+
+    case STATE_KEY_LENGTH:      //key length, the key itself follows right after it
+      if ((status = receiveExpected(conn, conn->lengthField)) <= 0){
+        return status;
+      }
+      if ((length = parseLengthField(conn)) < 0 || (request = conn->receiving = requestAcquire(conn)) == NULL
+          || legacyBuffer(&request->keyBuffer, &request->keyCapacity, length) == NULL){
+        return -1;
+      }
+      request->keyLength = length;
+      traceRecord(conn->service->trace, TRACE_LENGTH, conn->traceId, length);
+      expect(conn, STATE_KEY, paddedLength(length));
+      return 1;
+
+    case STATE_KEY:
+      if ((status = receiveExpected(conn, request->keyBuffer)) <= 0){
+        return status;
+      }
+      queueReply(conn, "s", 1);       //we have read the key
+      metricsRecordPhase(conn->service->metrics, PHASE_KEY, conn->phaseStart);
+      traceRecord(conn->service->trace, TRACE_KEY, conn->traceId, request->keyLength);
+      conn->phaseStart = metricsClock(conn->service->metrics);
+      expect(conn, STATE_TEXT_LENGTH, LEGACY_LENGTH_FIELD);
+      return 1;
+
+    case STATE_TEXT_LENGTH:
+      if ((status = receiveExpected(conn, conn->lengthField)) <= 0){
+        return status;
+      }
+      if ((length = parseLengthField(conn)) < 0 || (size_t) length > request->keyLength
+          || legacyBuffer(&request->textBuffer, &request->textCapacity, length) == NULL){
+        return -1;            //the key has to cover the whole text
+      }
+      request->textLength = length;
+      traceRecord(conn->service->trace, TRACE_LENGTH, conn->traceId, length);
+      queueReply(conn, "s", 1);       //we have read the text length
+      expect(conn, STATE_TEXT, paddedLength(length));
+      return 1;
+
+    case STATE_TEXT:
+      if ((status = receiveExpected(conn, request->textBuffer)) <= 0){
+        return status;
+      }
+      metricsRecordPhase(conn->service->metrics, PHASE_TEXT, conn->phaseStart);
+      traceRecord(conn->service->trace, TRACE_TEXT, conn->traceId, request->textLength);
+      uint64_t started = metricsClock(conn->service->metrics);
+      runTransform(conn->service, request->operation->transform, request->textBuffer, request->keyBuffer, request->textLength);
+      metricsRecordPhase(conn->service->metrics, PHASE_TRANSFORM, started);
+      traceRecord(conn->service->trace, TRACE_TRANSFORM, conn->traceId, request->textLength);
+      metricsAdd(conn->service->metrics, METRIC_REQUESTS, 1);
+      //send "ready" and the length of the result, then wait for the client to acknowledge it
+      memset(conn->lengthField, '\0', sizeof(conn->lengthField));
+      snprintf(conn->lengthField, sizeof(conn->lengthField), "%zu", request->textLength);
+      queueReply(conn, "r", 1);
+      queueReply(conn, conn->lengthField, LEGACY_LENGTH_FIELD);
+      expect(conn, STATE_RESULT_ACK, 1);
+      return 1;
+
+    case STATE_RESULT_ACK:
+      if ((status = receiveExpected(conn, testBuffer)) <= 0){
+        return status;
+      }
+      if (testBuffer[0] != 's'){
+        return -1;
+      }
+      //send the result padded with NULs to whole 1k chunks, the client reads it as a string
+      queueData(conn, request->textBuffer, request->textLength);
+      queueData(conn, zeroPadding, paddedLength(request->textLength) - request->textLength);
+      request->readyAt = metricsClock(conn->service->metrics);
+      expect(conn, STATE_CLOSING, 0);
+      return 1;
+
+    case STATE_CLOSING:
+      return 0;
+
+    case STATE_DRAIN:
+      return drainInput(conn);
+  }
+  return -1;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+
+// nothing left to send
+static int outputIdle(const struct connection *conn){
+  return conn->outCount == 0 && conn->responseHead == NULL;
+}
+
+// whether the connection should read from the socket now
+static int canRead(const struct connection *conn){
+  switch (conn->state){
+    case STATE_CLOSING:
+      return 0;
+    case STATE_DRAIN:             //hang up only after every earlier result went out
+      return outputIdle(conn);
+    case STATE_STREAM_KEY:        //the window is full, wait until the client reads the results
+    case STATE_STREAM_TEXT:
+      return conn->responseCount < STREAM_WINDOW_CHUNKS;
+    default:                      //stop reading requests while too many results wait to be sent
+      return conn->responseCount < MAX_PIPELINED_RESPONSES;
+  }
+}
+
+struct connection *connectionCreate(int fd, const struct otpService *service){
+  struct connection *conn = idleConnections;
+  if (conn != NULL){
+    idleConnections = conn->idleNext;
+    idleConnectionCount--;
+  } else if ((conn = malloc(sizeof(struct connection))) == NULL){
+    return NULL;
+  }
+  memset(conn, '\0', sizeof(*conn));
+  conn->fd = fd;
+  conn->service = service;
+  conn->passedFD = -1;
+  conn->phaseStart = metricsClock(service->metrics);
+  metricsAdd(service->metrics, METRIC_CONNECTIONS_ACTIVE, 1);
+  conn->traceId = ++lastTraceId;
+  traceRecord(service->trace, TRACE_ACCEPT, conn->traceId, fd);
+  expect(conn, STATE_HANDSHAKE, 1);
+  return conn;
+}
+
+static void releaseRequestList(struct pendingRequest *request){
+  while (request != NULL){
+    struct pendingRequest *next = request->next;
+    requestRelease(request);
+    request = next;
+  }
+}
+
+void connectionDestroy(struct connection *conn){
+  metricsAdd(conn->service->metrics, METRIC_CONNECTIONS_ACTIVE, -1);
+  traceRecord(conn->service->trace, TRACE_CLOSE, conn->traceId, conn->requestsServed);
+  if (conn->receiving != NULL){
+    requestRelease(conn->receiving);
+  }
+  releaseRequestList(conn->responseHead);
+  releaseRequestList(conn->retiring);
+  if (conn->passedFD >= 0){
+    close(conn->passedFD);
+  }
+  if (conn->region != NULL){
+    munmap(conn->region, conn->regionSize);
+  }
+  if (idleConnectionCount < MAX_IDLE_CONNECTIONS){      //the event loop is done with it, idleNext is ours now
+    conn->idleNext = idleConnections;
+    idleConnections = conn;
+    idleConnectionCount++;
+  } else {
+    free(conn);
+  }
+}
+
+int connectionProcess(struct connection *conn){
+  while (1){
+    int progress = 0;
+    if (conn->outCount == 0){
+      fillOutput(conn);
+    }
+    if (conn->outCount > 0){
+      int status = flushOutput(conn);
+      if (status < 0){
+        return -1;
+      }
+      progress |= status;
+    }
+    if (conn->state == STATE_CLOSING && outputIdle(conn)){      //everything has been sent
+      if (conn->receiving != NULL){         //an old client's result
+        metricsRecordPhase(conn->service->metrics, PHASE_SEND, conn->receiving->readyAt);
+        traceRecord(conn->service->trace, TRACE_SENT, conn->traceId, conn->receiving->textLength);
+      }
+      return -1;
+    }
+    if (canRead(conn)){           //keep reading pipelined requests while results are being sent
+      int status = step(conn);
+      if (status < 0){
+        return -1;
+      }
+      progress |= status;
+    }
+    if (!progress){
+      return 0;
+    }
+  }
+}
+
+int connectionEvents(const struct connection *conn){
+  int events = 0;
+  if (canRead(conn)){
+    events |= CONNECTION_WANTS_READ;
+  }
+  if (conn->outCount > 0){
+    events |= CONNECTION_WANTS_WRITE;
+  }
+  return events;
+}
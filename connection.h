@@ -0,0 +1,163 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "otp_protocol.h"
+#include "pad_store.h"
+#include "server_metrics.h"
+#include "server_trace.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* Per-connection protocol state machine shared by enc_server and dec_server.
+* A connection never blocks: it reads whatever the socket has, advances through the
+* protocol and queues the replies. The caller (event loop or forked child) only has to
+* wait for the socket to become readable/writable again and call connectionProcess().
+*
+* The first byte picks the protocol:
+* 'O'      binary protocol (otp_protocol.h): header -> key -> text, answered with header -> result
+* 't'/'p'  old lockstep protocol: handshake -> key length -> key -> text length -> text -> result
+*
+* A service offers one or more operations (encryption, decryption): binary requests pick theirs
+* with the magic of every header, old clients with their test message.
+*
+* Binary requests can be pipelined. While earlier results are still being sent the connection
+* keeps reading the next requests, up to MAX_PIPELINED_RESPONSES waiting results. Streamed
+* requests are transformed chunk by chunk, with at most STREAM_WINDOW_CHUNKS chunks in memory;
+* a stream at least as long as the parallel threshold is received in batches of chunks that
+* large instead, and every batch is transformed on the pool and answered as one fragment.
+* Packed requests are unpacked into symbols, transformed with transformSymbols and packed again, all in place.
+* Shared requests (Unix socket connections) are transformed right in the region the client mapped for the connection.
+* A very large text is cut into cache-sized pieces that are transformed in parallel (thread_pool.h).
+* Key/text buffers come from the worker's buffer pool (buffer_pool.h) and go back to it after every request.
+* With service->metrics it counts what it does and times the phases of every request (server_metrics.h),
+* with service->trace it records every step of every request (server_trace.h).
+*/
+
+// transforms length chars of text in place using the key (encryption or decryption)
+typedef void (*transformFunction)(char *text, const char *key, size_t length);
+
+// something a server does with the text: which test message and magic ask for it, and how it is done
+struct otpOperation {
+  char handshake;                 // 't' for encryption, 'p' for decryption
+  uint32_t magic;                 // OTP_MAGIC_ENCRYPT or OTP_MAGIC_DECRYPT
+  transformFunction transform;
+  transformFunction transformSymbols;     // the same on symbols 0..26, for packed requests
+  int consumesPads;               // encryption: every pad segment is used only once
+};
+
+#define MAX_SERVICE_OPERATIONS 2
+
+// what a server is: the operations it offers and how it treats its connections
+struct otpService {
+  const struct otpOperation *operations[MAX_SERVICE_OPERATIONS];
+  int operationCount;
+  unsigned long maxRequests;      // keep-alive requests served on one connection before closing it (0 = no limit)
+  struct padStore *pads;          // pads requests can take their key from (NULL: none)
+  size_t parallelThreshold;       // texts at least this long are transformed on transformThreads threads (0 = never)
+  int transformThreads;           // per process, the caller included
+  struct serverMetrics *metrics;  // shared by every process of the server (NULL: no metrics)
+  struct serverTrace *trace;      // the same (NULL: no tracing)
+};
+
+enum connectionState {
+  STATE_HANDSHAKE,                // waiting for the first byte (test message or start of a header)
+  STATE_HEADER,                   // binary: reading the (rest of the) request header
+  STATE_BODY_KEY,                 // binary: reading keyLength key bytes
+  STATE_BODY_TEXT,                // binary: reading textLength text bytes
+  STATE_STREAM_KEY,               // binary stream: reading the key bytes of the next chunk
+  STATE_STREAM_TEXT,              // binary stream: reading the text bytes of that chunk
+  STATE_SHARED_BODY,              // binary shared: reading the offsets of key and text in the shared region
+  STATE_SKIP_BODY,                // binary: discarding the body of a rejected request
+  STATE_KEY_LENGTH,               // reading the key length field
+  STATE_KEY,                      // reading the key (padded to whole 1k chunks by the client)
+  STATE_TEXT_LENGTH,              // reading the text length field
+  STATE_TEXT,                     // reading the text (padded to whole 1k chunks by the client)
+  STATE_RESULT_ACK,               // sent 'r' + result length, waiting for the client's 's'
+  STATE_CLOSING,                  // old protocol: close once the output drains
+  STATE_DRAIN                     // no more requests: once every queued response is sent, discard input until the client hangs up
+};
+
+#define MAX_PIPELINED_RESPONSES 64      // stop reading requests while this many results wait to be sent
+#define STREAM_WINDOW_CHUNKS 4          // stop reading a streamed request while this many results wait to be sent
+#define MAX_FRAMES_PER_WRITE 8          // response frames handed to a single sendmsg
+#define CONNECTION_MAX_IOV (2 * MAX_FRAMES_PER_WRITE + 2)
+
+// one request (or one chunk of a streamed request): its buffers while it is received, then its result while it is sent
+struct pendingRequest {
+  struct otpHeader header;        // as received (binary requests)
+  const struct otpOperation *operation;
+  int status;                     // OTP_STATUS_* of the response
+  char *keyBuffer;
+  const char *key;                // the key for the text: keyBuffer or a segment of a pad
+  size_t keyLength;               // key chars announced by the client
+  size_t keyCapacity;             // bytes of keyBuffer (from the worker's buffer pool)
+  char *textBuffer;
+  size_t textLength;              // text chars announced by the client
+  size_t textCapacity;
+  uint64_t offset;                // where the result goes in the whole result (chunks of a streamed request)
+  int more;                       // more chunks of the same result follow this one
+  int announcePad;                // the response starts with the pad offset that was used
+  uint64_t padOffset;
+  size_t sent;                    // result bytes already queued for sending
+  uint64_t readyAt;               // when the result was ready to be sent (metricsClock)
+  struct pendingRequest *next;
+};
+
+struct connection {
+  int fd;
+  const struct otpService *service;
+  const struct otpOperation *operation;           // of the request being received
+  enum connectionState state;
+
+  unsigned char headerBuffer[OTP_HEADER_SIZE];   // binary request header being received
+  struct otpHeader request;                       // the same header, decoded
+  char lengthField[16];           // ascii length field being received / sent
+  size_t expected;                // bytes to read in the current state
+  size_t filled;                  // bytes read so far in the current state
+  unsigned long requestsServed;
+  uint64_t streamed;              // text bytes of the streamed request received so far
+  size_t batchFilled;             // text chars of the batch of chunks being received
+  const char *padKey;             // pad requests: the segment of the pad used as the key
+  uint64_t padOffset;
+  int passedFD;                   // the last descriptor the client passed over a Unix socket (-1: none)
+  char *region;                   // the region shared by the client, mapped (NULL: none)
+  size_t regionSize;
+  unsigned char sharedBody[OTP_SHARED_BODY_SIZE];
+  uint64_t phaseStart;            // metrics: when the phase being received began (accept for the handshake)
+  int greeted;                    // the first request header (or test message) has arrived
+  uint32_t traceId;               // names the connection in the trace
+
+  struct pendingRequest *receiving;               // request whose key/text is being read
+  struct pendingRequest *responseHead, *responseTail;   // transformed, waiting to be sent
+  int responseCount;
+  struct pendingRequest *retiring;                // fully queued results, released once the output drains
+
+  struct iovec out[CONNECTION_MAX_IOV];   // queued output, sent with a single sendmsg
+  int outCount;
+  char outSmall[2 * MAX_FRAMES_PER_WRITE * OTP_HEADER_SIZE];   // storage for short replies ('t', 's', 'r' + length, response headers)
+  size_t outSmallLength;
+
+  long lastActive;                // owned by the event loop: idle timeout bookkeeping
+  struct connection *idlePrev, *idleNext;
+};
+
+#define CONNECTION_WANTS_READ  1
+#define CONNECTION_WANTS_WRITE 2
+
+struct connection *connectionCreate(int fd, const struct otpService *service);
+void connectionDestroy(struct connection *conn);
+
+// read/write as much as possible without blocking, returns 0 to keep the connection, -1 to close it
+int connectionProcess(struct connection *conn);
+
+// what the connection waits for: CONNECTION_WANTS_READ and/or CONNECTION_WANTS_WRITE
+int connectionEvents(const struct connection *conn);
+
+#endif
@@ -0,0 +1,81 @@
+#include "histogram.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+static int bucketOf(uint64_t value){
+  if (value < 2 * HISTOGRAM_SUB_BUCKETS){
+    return (int) value;
+  }
+  int exponent = 63 - __builtin_clzll(value);         //value is in [2^exponent, 2^(exponent + 1))
+  int shift = exponent - HISTOGRAM_SUB_BITS;
+  return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int) ((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+// the largest value that lands in bucket
+static uint64_t bucketTop(int bucket){
+  if (bucket < 2 * HISTOGRAM_SUB_BUCKETS){
+    return bucket;
+  }
+  int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t low = (uint64_t) (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+  return low + (((uint64_t) 1 << shift) - 1);
+}
+
+void histogramRecord(struct histogram *histogram, uint64_t value){
+  histogram->counts[bucketOf(value)]++;
+  histogram->total++;
+  histogram->sum += value;
+  if (value > histogram->max){
+    histogram->max = value;
+  }
+}
+
+void histogramRecordAtomic(struct histogram *histogram, uint64_t value){
+  __atomic_fetch_add(&histogram->counts[bucketOf(value)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->total, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+  while (value > max && !__atomic_compare_exchange_n(&histogram->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+  }
+}
+
+void histogramMerge(struct histogram *into, const struct histogram *from){
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++){
+    into->counts[i] += from->counts[i];
+  }
+  into->total += from->total;
+  into->sum += from->sum;
+  if (from->max > into->max){
+    into->max = from->max;
+  }
+}
+
+uint64_t histogramPercentile(const struct histogram *histogram, double percentile){
+  if (histogram->total == 0){
+    return 0;
+  }
+  //the rank of the value we want, 1-based: the smallest one with at least percentile % at or below it
+  uint64_t rank = (uint64_t) (percentile / 100.0 * histogram->total + 0.999999);
+  if (rank < 1){
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++){
+    seen += histogram->counts[i];
+    if (seen >= rank){
+      uint64_t top = bucketTop(i);
+      return top < histogram->max ? top : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+uint64_t histogramCountAtOrBelow(const struct histogram *histogram, uint64_t value){
+  uint64_t count = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS && bucketTop(i) <= value; i++){
+    count += histogram->counts[i];
+  }
+  return count;
+}
@@ -0,0 +1,46 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* Latency histogram with a fixed relative precision (the HdrHistogram layout): values below
+* 2 * HISTOGRAM_SUB_BUCKETS have a bucket each, above that every power of two is cut into
+* HISTOGRAM_SUB_BUCKETS buckets, so a value is never off by more than 1/64 of itself. All of
+* uint64_t fits in HISTOGRAM_BUCKETS counters and recording is a couple of shifts, no search.
+*
+* A histogram is plain memory with no pointers: zero it to start, record into one per thread
+* and merge them for the report. One shared between threads or processes (a MAP_SHARED mapping)
+* is recorded into with histogramRecordAtomic.
+*/
+
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total;                 // values recorded
+  uint64_t sum;
+  uint64_t max;
+};
+
+void histogramRecord(struct histogram *histogram, uint64_t value);
+
+// the same with atomic adds, for a histogram others record into at the same time
+void histogramRecordAtomic(struct histogram *histogram, uint64_t value);
+
+// add the values of from to into
+void histogramMerge(struct histogram *into, const struct histogram *from);
+
+// the value percentile % of the recorded values are at or below (the top of its bucket), 0 if there are none
+uint64_t histogramPercentile(const struct histogram *histogram, double percentile);
+
+// values recorded in the buckets that end at or below value (within the bucket precision of value)
+uint64_t histogramCountAtOrBelow(const struct histogram *histogram, uint64_t value);
+
+#endif
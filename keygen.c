@@ -1,39 +1,193 @@
-#include <stdlib.h>             //rand, rand_r, srand - pseudo-random number generator
-#include <time.h>               //time(NULL)
+#define _GNU_SOURCE             // fallocate()
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <err.h>
+#include <pthread.h>
+
+#include "otp_random.h"         //ChaCha20 keyed from getrandom(), unbiased characters
 
 /*
  programmed by Artem Kolpakov
 */
 
-//The characters in the file generated will be any of the 27 allowed characters
-static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
-                               //0 --------------------- 26//
+//The characters in the file generated will be any of the 27 allowed characters "ABCDEFGHIJKLMNOPQRSTUVWXYZ ",
+//every one of them equally likely (see otp_random.h). The key is made and written in blocks, so a key of any size
+//needs the same few MB of memory (per thread).
+//
+//Every block comes from its own ChaCha20 stream (the stream number is the block number, all under the same seed),
+//so the blocks can be generated in any order, on any number of threads, and the key doesn't depend on how many
+//threads made it. A thread takes the next block number, generates the block and writes it at its offset in the
+//file; when the output is a pipe or terminal the blocks are written in order instead.
+
+#define BLOCK_SIZE (4 * 1024 * 1024)     //characters generated and written at a time
+#define BLOCK_ALIGNMENT 4096             //page aligned buffer, the writes go straight from it
+#define MAX_THREADS 1024
+
+struct generator {
+    const unsigned char *seed;
+    uint64_t keylength;
+    uint64_t blocks;                    //blocks in the key, the last one ends with the newline
+    uint64_t nextBlock;                 //next block a thread can take (atomic)
+    int fd;
+    int seekable;                       //pwrite at the block offsets, otherwise write in block order
+    pthread_mutex_t lock;               //not seekable: the block to be written next
+    pthread_cond_t turn;
+    uint64_t writtenBlocks;
+};
+
+static void usage(const char *program){
+    fprintf(stderr, "Usage: %s [-o <keyfile>] [-T <threads>] <keylength>\n", program);
+    exit(EXIT_FAILURE);
+}
+
+//the key length as a 64-bit number, digits only
+static uint64_t parseLength(const char *text, const char *program){
+    char *end = NULL;
+    if (*text < '0' || *text > '9'){
+        usage(program);
+    }
+    errno = 0;
+    unsigned long long length = strtoull(text, &end, 10);
+    if (*end != '\0' || errno != 0 || length == UINT64_MAX){      //UINT64_MAX: no room for the newline
+        usage(program);
+    }
+    return length;
+}
+
+//write a whole block at offset (or at the current position of a pipe/terminal when offset is -1)
+static void writeBlock(int fd, const char *data, size_t length, off_t offset){
+    while (length > 0){
+        ssize_t written = offset >= 0 ? pwrite(fd, data, length, offset) : write(fd, data, length);
+        if (written < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            err(EXIT_FAILURE, "write()");
+        }
+        data += written;
+        length -= written;
+        if (offset >= 0){
+            offset += written;
+        }
+    }
+}
+
+//one thread: generate and write blocks until there are none left
+static void *generateBlocks(void *argument){
+    struct generator *generator = argument;
+    char *block;
+    if (posix_memalign((void**) &block, BLOCK_ALIGNMENT, BLOCK_SIZE + 1) != 0){      //+1 because of the newline
+        errx(EXIT_FAILURE, "out of memory");
+    }
+    struct otpRandom random;
+    uint64_t index;
+    while ((index = __atomic_fetch_add(&generator->nextBlock, 1, __ATOMIC_RELAXED)) < generator->blocks){
+        uint64_t start = index * BLOCK_SIZE;
+        size_t length = generator->keylength - start < BLOCK_SIZE ? generator->keylength - start : BLOCK_SIZE;
+        otpRandomInit(&random, generator->seed, index);
+        otpRandomText(&random, block, length);      //filling the block with random chars
+        if (index == generator->blocks - 1){
+            block[length++] = '\n';                 //add a newline after the last char in key
+        }
+
+        if (generator->seekable){
+            writeBlock(generator->fd, block, length, start);
+            continue;
+        }
+        pthread_mutex_lock(&generator->lock);
+        while (generator->writtenBlocks != index){
+            pthread_cond_wait(&generator->turn, &generator->lock);
+        }
+        pthread_mutex_unlock(&generator->lock);
+        writeBlock(generator->fd, block, length, -1);
+        pthread_mutex_lock(&generator->lock);
+        generator->writtenBlocks++;
+        pthread_cond_broadcast(&generator->turn);
+        pthread_mutex_unlock(&generator->lock);
+    }
+    explicit_bzero(&random, sizeof(random));
+    explicit_bzero(block, BLOCK_SIZE + 1);
+    free(block);
+    return NULL;
+}
+
 int main(int argc, char *argv[]){
-    if (argc != 2) {            //if there is more/less than 1 arguments provided
-        fprintf(stderr, "Usage: %s <keylength>\n", argv[0]);
-        exit(EXIT_FAILURE);
+    const char *outputPath = NULL;          //-o: write to this file instead of stdout
+    long threads = 1;                       //-T: threads generating blocks
+    char *end = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "o:T:")) != -1){
+        switch (option){
+            case 'o':
+                outputPath = optarg;
+                break;
+            case 'T':
+                threads = strtol(optarg, &end, 10);
+                if (*end != '\0' || threads < 1 || threads > MAX_THREADS){
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {            //if there is more/less than 1 length provided
+        usage(argv[0]);
     }
 
-    srand(time(NULL));                      //generating a pseudo-random random seed
-    int keylength;                          //length of the key file in characters
-    keylength = atoi(argv[1]);              //converting string argument[1] to  integer
-    char mykey[keylength + 1];              //+1 because of the newline
-    memset(mykey, '\0', keylength+1);       //initializing key with null terminators
+    struct generator generator;
+    memset(&generator, 0, sizeof(generator));
+    generator.keylength = parseLength(argv[optind], argv[0]);     //length of the key file in characters
+    generator.blocks = generator.keylength / BLOCK_SIZE + 1;     //a key of whole blocks still needs one more for the newline
+    if (generator.keylength > 0 && generator.keylength % BLOCK_SIZE == 0){
+        generator.blocks--;
+    }
+    if ((uint64_t) threads > generator.blocks){
+        threads = generator.blocks;
+    }
 
-    for (int i = 0; i < keylength+1; i++) {     //filling key char array with random chars
-        if(i != keylength){
-            mykey[i] = alphabet[random() % 27];   //0-26, generate a random char out of the 27 allowed characters declared in the static alphabet array
-        } else {
-            mykey[i] = '\n';                      //add a newline if it's the last char in key
+    unsigned char seed[OTP_RANDOM_KEY_SIZE];
+    if (otpRandomKey(seed) < 0){            //fresh entropy from the kernel for every run
+        err(EXIT_FAILURE, "getrandom()");
+    }
+    generator.seed = seed;
+
+    generator.fd = STDOUT_FILENO;
+    if (outputPath != NULL){
+        generator.fd = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (generator.fd < 0){
+            err(EXIT_FAILURE, "open(%s)", outputPath);
+        }
+        //reserve the whole file up front: no running out of space halfway, and the blocks stay contiguous on disk
+        if (fallocate(generator.fd, 0, 0, generator.keylength + 1) < 0 && errno != EOPNOTSUPP && errno != ENOSYS){
+            err(EXIT_FAILURE, "fallocate(%s)", outputPath);
+        }
+        generator.seekable = 1;
+    }
+    pthread_mutex_init(&generator.lock, NULL);
+    pthread_cond_init(&generator.turn, NULL);
+
+    pthread_t helpers[MAX_THREADS];
+    for (long i = 1; i < threads; i++){
+        int error = pthread_create(&helpers[i], NULL, generateBlocks, &generator);
+        if (error != 0){
+            errno = error;
+            err(EXIT_FAILURE, "pthread_create()");
         }
     }
-    printf("%s", mykey);    //will be used with redirecting stdout to a file, write the generated key
-    fflush(stdout);         //flush out the contents of an output stream
+    generateBlocks(&generator);             //this thread takes blocks too
+    for (long i = 1; i < threads; i++){
+        pthread_join(helpers[i], NULL);
+    }
+    explicit_bzero(seed, sizeof(seed));
 
+    if (outputPath != NULL && close(generator.fd) < 0){
+        err(EXIT_FAILURE, "close(%s)", outputPath);
+    }
     exit(EXIT_SUCCESS);
 }
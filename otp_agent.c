@@ -0,0 +1,653 @@
+#define _GNU_SOURCE             // accept4()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>      // gethostbyname()
+
+#include <err.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+
+#include "otp_agent.h"
+#include "otp_protocol.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* Agent code
+* 1. Listen on a Unix socket for clients that introduce themselves with a hello naming the server port.
+* 2. Relay their requests over a warm connection to that server (a new one if the pool has none) and the results back.
+* 3. Once a client's last request is answered, hang up on the client and keep the server connection for the next one.
+* Everything runs in a single epoll loop, the sessions never block.
+*/
+
+#define MAX_EVENTS 256          // epoll events handled per wakeup
+#define RELAY_BUFFER (256 * 1024)       // bytes in flight in each direction of a session
+#define DEFAULT_MAX_WARM 16     // idle server connections kept per port
+#define MAX_IDLE_SESSIONS 16    // finished sessions kept for reuse (their buffers are large)
+#define LISTEN_BACKLOG 1024
+
+static volatile sig_atomic_t stopRequested = 0;     // set by SIGTERM/SIGINT
+
+enum endpointKind {
+  ENDPOINT_LISTENER,
+  ENDPOINT_CLIENT,                // the client side of a session
+  ENDPOINT_SERVER,                // the server side of a session
+  ENDPOINT_WARM                   // an idle server connection in the pool
+};
+
+struct session;
+struct warmConnection;
+
+// what epoll hands back: one of the sockets of the agent, fd is -1 once it was closed during the current wakeup
+struct endpoint {
+  enum endpointKind kind;
+  int fd;
+  uint32_t events;                // what epoll watches it for
+  struct session *session;
+  struct warmConnection *warm;
+};
+
+// one direction of a session: the bytes read from one side that still have to be written to the other,
+// and where the frame they belong to ends
+struct relay {
+  char *buffer;
+  size_t start, end;              // bytes [start, end) wait to be written
+  unsigned char header[OTP_HEADER_SIZE];      // frame header being passed, as received
+  size_t headerFilled;
+  uint64_t bodyLeft;              // bytes of the current frame's body still to pass
+  int closed;                     // nothing more comes from the reading side
+};
+
+struct session {
+  struct endpoint client, server;
+  int port;
+  unsigned char hello[OTP_AGENT_HELLO_SIZE];
+  size_t helloFilled;
+  int connecting;                 // the connection to the server is being set up
+  struct relay requests, responses;
+  uint64_t forwarded;             // requests relayed to the server
+  uint64_t answered;              // responses complete (the last frame of a request)
+  int lastRequest;                // the client sent a request without keep-alive, nothing follows it
+  int serverFinished;             // the server sent its last frame on this connection
+  int passThrough;                // something that isn't a response came back, the connection can't be reused
+  struct session *nextDead;
+  char requestBuffer[RELAY_BUFFER];       // everything from here on isn't cleared when the session is reused
+  char responseBuffer[RELAY_BUFFER];
+};
+
+struct warmConnection {
+  struct endpoint endpoint;
+  int port;
+  struct warmConnection *prev, *next;
+};
+
+struct agent {
+  int epollFD;
+  struct sockaddr_in serverAddress;       // localhost, the port comes from the hello
+  int maxWarm;
+  struct warmConnection *warm;            // the pool, most recently used first
+  struct session *deadSessions;           // closed during the current wakeup, recycled after it
+  struct warmConnection *deadWarm;
+  struct session *idleSessions;
+  int idleSessionCount;
+};
+
+// Error function used for reporting issues
+static void error(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+static void usage(const char *program){
+  fprintf(stderr, "USAGE: %s [-n warm_connections] <socket_path>\n", program);
+  exit(1);
+}
+
+static void requestStop(int sig){
+  (void) sig;
+  stopRequested = 1;
+}
+
+// Set up the address struct of the servers, the same host the clients would connect to
+static void setupAddressStruct(struct sockaddr_in* address, char* hostname){
+  memset((char*) address, '\0', sizeof(*address));
+  address->sin_family = AF_INET;
+  struct hostent* hostInfo = gethostbyname(hostname);
+  if (hostInfo == NULL) {
+    fprintf(stderr, "AGENT: ERROR, no such host\n");
+    exit(1);
+  }
+  memcpy((char*) &address->sin_addr.s_addr, hostInfo->h_addr_list[0], hostInfo->h_length);
+}
+
+static void watchAlways(struct agent *agent, struct endpoint *endpoint, uint32_t events){
+  struct epoll_event event;
+  event.events = events;
+  event.data.ptr = endpoint;
+  epoll_ctl(agent->epollFD, EPOLL_CTL_MOD, endpoint->fd, &event);
+  endpoint->events = events;
+}
+
+static void watch(struct agent *agent, struct endpoint *endpoint, uint32_t events){
+  if (endpoint->events != events){
+    watchAlways(agent, endpoint, events);
+  }
+}
+
+static int watchNew(struct agent *agent, struct endpoint *endpoint, uint32_t events){
+  struct epoll_event event;
+  event.events = events;
+  event.data.ptr = endpoint;
+  endpoint->events = events;
+  return epoll_ctl(agent->epollFD, EPOLL_CTL_ADD, endpoint->fd, &event);
+}
+
+static void closeEndpoint(struct agent *agent, struct endpoint *endpoint){
+  epoll_ctl(agent->epollFD, EPOLL_CTL_DEL, endpoint->fd, NULL);
+  close(endpoint->fd);
+  endpoint->fd = -1;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// the pool of warm server connections
+
+static void warmRemove(struct agent *agent, struct warmConnection *warm){
+  if (warm->prev != NULL){
+    warm->prev->next = warm->next;
+  } else {
+    agent->warm = warm->next;
+  }
+  if (warm->next != NULL){
+    warm->next->prev = warm->prev;
+  }
+  warm->prev = NULL;
+  warm->next = agent->deadWarm;     //freed after the wakeup, epoll may still have an event for it
+  agent->deadWarm = warm;
+}
+
+// keep a server connection that answered everything it was asked for the next client, or close it if the pool is full
+static void warmPut(struct agent *agent, int fd, int port){
+  int count = 0;
+  for (struct warmConnection *warm = agent->warm; warm != NULL; warm = warm->next){
+    count += warm->port == port;
+  }
+  struct warmConnection *warm = count < agent->maxWarm ? calloc(1, sizeof(struct warmConnection)) : NULL;
+  if (warm == NULL){
+    epoll_ctl(agent->epollFD, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    return;
+  }
+  warm->endpoint.kind = ENDPOINT_WARM;
+  warm->endpoint.fd = fd;
+  warm->endpoint.warm = warm;
+  warm->port = port;
+  warm->next = agent->warm;
+  if (agent->warm != NULL){
+    agent->warm->prev = warm;
+  }
+  agent->warm = warm;
+  watchAlways(agent, &warm->endpoint, EPOLLIN | EPOLLRDHUP);      //all an idle connection can tell us is that the server hung up
+}
+
+// a pooled connection to port that is still open (still registered with epoll), -1 if there is none
+static int warmTake(struct agent *agent, int port){
+  struct warmConnection *next;
+  for (struct warmConnection *warm = agent->warm; warm != NULL; warm = next){
+    next = warm->next;
+    if (warm->port != port){
+      continue;
+    }
+    char byte;
+    int fd = warm->endpoint.fd;
+    ssize_t peeked = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    warm->endpoint.fd = -1;
+    warmRemove(agent, warm);
+    if (peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+      return fd;
+    }
+    epoll_ctl(agent->epollFD, EPOLL_CTL_DEL, fd, NULL);      //the server hung up (e.g. its idle timeout) since the last wakeup
+    close(fd);
+  }
+  return -1;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// relaying the frames of a session
+
+// read into the free space of the relay, returns the bytes read (at its end), 0 if nothing fits or nothing came, -1 once the peer is gone
+static ssize_t relayRead(int fd, struct relay *relay){
+  if (relay->start == relay->end){
+    relay->start = relay->end = 0;
+  } else if (relay->end == RELAY_BUFFER && relay->start > 0){
+    memmove(relay->buffer, relay->buffer + relay->start, relay->end - relay->start);
+    relay->end -= relay->start;
+    relay->start = 0;
+  }
+  if (relay->end == RELAY_BUFFER || relay->closed){
+    return 0;
+  }
+  while (1){
+    ssize_t charsRead = recv(fd, relay->buffer + relay->end, RELAY_BUFFER - relay->end, 0);
+    if (charsRead < 0 && errno == EINTR){
+      continue;
+    }
+    if (charsRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+      return 0;
+    }
+    if (charsRead <= 0){
+      relay->closed = 1;
+      return -1;
+    }
+    relay->end += charsRead;
+    return charsRead;
+  }
+}
+
+// write what the relay holds, returns 0, -1 once the peer is gone
+static int relayWrite(int fd, struct relay *relay){
+  while (relay->start < relay->end){
+    ssize_t charsWritten = send(fd, relay->buffer + relay->start, relay->end - relay->start, MSG_NOSIGNAL);
+    if (charsWritten < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    relay->start += charsWritten;
+  }
+  return 0;
+}
+
+// between two frames and nothing left to write
+static int relayIdle(const struct relay *relay){
+  return relay->headerFilled == 0 && relay->bodyLeft == 0 && relay->start == relay->end;
+}
+
+// Follow the requests in the bytes [from, end) on their way to the server. Every header is marked keep-alive,
+// the server connection has to outlive the client; a request without it is the last one of the client.
+static void passRequests(struct session *session, size_t from){
+  struct relay *relay = &session->requests;
+  while (from < relay->end){
+    if (relay->bodyLeft > 0){
+      size_t passed = relay->end - from < relay->bodyLeft ? relay->end - from : relay->bodyLeft;
+      from += passed;
+      relay->bodyLeft -= passed;
+      continue;
+    }
+    relay->header[relay->headerFilled] = relay->buffer[from];
+    if (relay->headerFilled == 5){      //the flags
+      relay->buffer[from] |= OTP_FLAG_KEEPALIVE;
+    }
+    from++;
+    if (++relay->headerFilled == OTP_HEADER_SIZE){
+      struct otpHeader request;
+      otpDecodeHeader(relay->header, &request);       //the server judges the request, the agent only needs its size
+      relay->headerFilled = 0;
+      relay->bodyLeft = otpRequestBodyLength(&request);
+      session->forwarded++;
+      if (!(request.flags & OTP_FLAG_KEEPALIVE)){
+        session->lastRequest = 1;
+      }
+    }
+  }
+}
+
+// follow the response frames in the bytes [from, end) on their way to the client
+static void passResponses(struct session *session, size_t from){
+  struct relay *relay = &session->responses;
+  while (from < relay->end && !session->passThrough){
+    if (relay->bodyLeft > 0){
+      size_t passed = relay->end - from < relay->bodyLeft ? relay->end - from : relay->bodyLeft;
+      from += passed;
+      relay->bodyLeft -= passed;
+      continue;
+    }
+    relay->header[relay->headerFilled++] = relay->buffer[from++];
+    if (relay->headerFilled == 1 && relay->header[0] != OTP_MAGIC_FIRST_BYTE){      //e.g. the 'f' of a server that won't talk to the client
+      session->passThrough = 1;
+    }
+    if (relay->headerFilled == OTP_HEADER_SIZE){
+      struct otpHeader frame;
+      relay->headerFilled = 0;
+      if (otpDecodeHeader(relay->header, &frame) < 0 || frame.magic != OTP_MAGIC_RESULT){
+        session->passThrough = 1;
+        return;
+      }
+      relay->bodyLeft = otpResponseBodyLength(&frame);
+      if (!(frame.flags & OTP_FLAG_MORE)){
+        session->answered++;
+      }
+      if (!(frame.flags & OTP_FLAG_KEEPALIVE)){
+        session->serverFinished = 1;
+      }
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// sessions: one client and the server connection it uses
+
+static struct session *sessionCreate(struct agent *agent, int clientFD){
+  struct session *session = agent->idleSessions;
+  if (session != NULL){
+    agent->idleSessions = session->nextDead;
+    agent->idleSessionCount--;
+  } else if ((session = malloc(sizeof(struct session))) == NULL){
+    return NULL;
+  }
+  memset(session, '\0', offsetof(struct session, requestBuffer));
+  session->client.kind = ENDPOINT_CLIENT;
+  session->client.fd = clientFD;
+  session->client.session = session;
+  session->server.kind = ENDPOINT_SERVER;
+  session->server.fd = -1;
+  session->server.session = session;
+  session->requests.buffer = session->requestBuffer;
+  session->responses.buffer = session->responseBuffer;
+  return session;
+}
+
+// close the client, and the server connection unless it goes back to the pool
+static void sessionEnd(struct agent *agent, struct session *session, int keepServer){
+  if (session->client.fd >= 0){
+    closeEndpoint(agent, &session->client);
+  }
+  if (session->server.fd >= 0){
+    if (keepServer && !session->connecting && !session->passThrough && !session->serverFinished){
+      warmPut(agent, session->server.fd, session->port);
+      session->server.fd = -1;
+    } else {
+      closeEndpoint(agent, &session->server);
+    }
+  }
+  session->nextDead = agent->deadSessions;     //recycled after the wakeup, epoll may still have an event for it
+  agent->deadSessions = session;
+}
+
+// the server can't be reached: answer like a server that refuses the client, then hang up
+static void sessionRefuse(struct agent *agent, struct session *session){
+  send(session->client.fd, "f", 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+  sessionEnd(agent, session, 0);
+}
+
+// the hello is complete: get a connection to the server it names, returns 1 on success, 0 if the server can't be reached, -1 for a bad hello
+static int sessionAttach(struct agent *agent, struct session *session){
+  const unsigned char *hello = session->hello;
+  uint32_t magic = ((uint32_t) hello[0] << 24) | (hello[1] << 16) | (hello[2] << 8) | hello[3];
+  if (magic != OTP_AGENT_MAGIC || hello[4] != OTP_AGENT_VERSION){
+    return -1;
+  }
+  session->port = (hello[6] << 8) | hello[7];
+  int fd = warmTake(agent, session->port);
+  if (fd >= 0){
+    session->server.fd = fd;
+    watchAlways(agent, &session->server, 0);      //the registration still points at the pool entry
+    return 1;
+  }
+
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0){
+    return 0;
+  }
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));      //a header is often relayed on its own
+  struct sockaddr_in address = agent->serverAddress;
+  address.sin_port = htons(session->port);
+  if (connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0){
+    if (errno != EINPROGRESS){
+      close(fd);
+      return 0;
+    }
+    session->connecting = 1;
+  }
+  session->server.fd = fd;
+  if (watchNew(agent, &session->server, EPOLLOUT) < 0){
+    close(fd);
+    session->server.fd = -1;
+    return 0;
+  }
+  return 1;
+}
+
+// what both sides of the session wait for
+static void sessionWatch(struct agent *agent, struct session *session){
+  struct relay *requests = &session->requests, *responses = &session->responses;
+  uint32_t clientEvents = 0;
+  if (session->helloFilled < OTP_AGENT_HELLO_SIZE || (!requests->closed && requests->end - requests->start < RELAY_BUFFER)){
+    clientEvents |= EPOLLIN;
+  }
+  if (responses->start < responses->end){
+    clientEvents |= EPOLLOUT;
+  }
+  watch(agent, &session->client, clientEvents);
+  if (session->server.fd >= 0){
+    uint32_t serverEvents = 0;
+    if (session->connecting || requests->start < requests->end){
+      serverEvents |= EPOLLOUT;
+    }
+    if (!session->connecting && !responses->closed && responses->end - responses->start < RELAY_BUFFER){
+      serverEvents |= EPOLLIN;
+    }
+    watch(agent, &session->server, serverEvents);
+  }
+}
+
+// move whatever can be moved in both directions, and end the session once it is over
+static void sessionProcess(struct agent *agent, struct session *session, struct endpoint *endpoint){
+  struct relay *requests = &session->requests, *responses = &session->responses;
+  if (endpoint == &session->server && session->connecting){
+    int problem = 0;
+    socklen_t length = sizeof(problem);
+    if (getsockopt(session->server.fd, SOL_SOCKET, SO_ERROR, &problem, &length) < 0 || problem != 0){
+      sessionRefuse(agent, session);
+      return;
+    }
+    session->connecting = 0;
+  }
+
+  if (session->helloFilled < OTP_AGENT_HELLO_SIZE){
+    ssize_t charsRead = recv(session->client.fd, session->hello + session->helloFilled, OTP_AGENT_HELLO_SIZE - session->helloFilled, 0);
+    if (charsRead == 0 || (charsRead < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+      sessionEnd(agent, session, 0);
+      return;
+    }
+    session->helloFilled += charsRead > 0 ? charsRead : 0;
+    if (session->helloFilled < OTP_AGENT_HELLO_SIZE){
+      return;
+    }
+    int attached = sessionAttach(agent, session);
+    if (attached < 0){
+      sessionEnd(agent, session, 0);
+      return;
+    }
+    if (attached == 0){
+      sessionRefuse(agent, session);
+      return;
+    }
+  }
+
+  //client -> server
+  ssize_t charsRead = relayRead(session->client.fd, requests);
+  if (charsRead > 0){
+    passRequests(session, requests->end - charsRead);
+  }
+  if (!session->connecting && relayWrite(session->server.fd, requests) < 0){
+    responses->closed = 1;        //the server is gone, pass on what it sent before
+  }
+  //server -> client
+  if (!session->connecting){
+    charsRead = relayRead(session->server.fd, responses);
+    if (charsRead > 0){
+      passResponses(session, responses->end - charsRead);
+    }
+  }
+  if (relayWrite(session->client.fd, responses) < 0){
+    sessionEnd(agent, session, 0);
+    return;
+  }
+
+  int responsesDone = relayIdle(responses) && session->answered == session->forwarded;
+  if (responses->start == responses->end && (responses->closed || (session->serverFinished && relayIdle(responses)))){
+    sessionEnd(agent, session, 0);      //the server hung up (or is about to), the client sends the rest over a new connection
+  } else if (requests->closed){
+    sessionEnd(agent, session, responsesDone && relayIdle(requests));     //the client is gone
+  } else if (session->lastRequest && relayIdle(requests) && responsesDone){
+    sessionEnd(agent, session, 1);      //everything answered: the client sees the hang up it expects after its last request
+  } else {
+    sessionWatch(agent, session);
+  }
+}
+
+// accept every pending client and wait for its hello
+static void acceptClients(struct agent *agent, int listenSocket){
+  while (1){
+    int clientSocket = accept4(listenSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (clientSocket < 0){
+      if (errno == EINTR || errno == ECONNABORTED){
+        continue;
+      }
+      return;                   // no more pending clients (or out of descriptors, retry on the next wakeup)
+    }
+    struct session *session = sessionCreate(agent, clientSocket);
+    if (session == NULL || watchNew(agent, &session->client, EPOLLIN) < 0){
+      close(clientSocket);
+      if (session != NULL){
+        session->client.fd = -1;
+        sessionEnd(agent, session, 0);
+      }
+    }
+  }
+}
+
+// sessions and pool entries closed during the wakeup can't get any more events
+static void recycleDead(struct agent *agent){
+  while (agent->deadSessions != NULL){
+    struct session *session = agent->deadSessions;
+    agent->deadSessions = session->nextDead;
+    if (agent->idleSessionCount < MAX_IDLE_SESSIONS){
+      session->nextDead = agent->idleSessions;
+      agent->idleSessions = session;
+      agent->idleSessionCount++;
+    } else {
+      free(session);
+    }
+  }
+  while (agent->deadWarm != NULL){
+    struct warmConnection *warm = agent->deadWarm;
+    agent->deadWarm = warm->next;
+    free(warm);
+  }
+}
+
+static int createListenSocket(const char *path){
+  struct sockaddr_un address;
+  memset(&address, '\0', sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)){
+    fprintf(stderr, "AGENT: ERROR, socket path too long\n");
+    exit(1);
+  }
+  strcpy(address.sun_path, path);
+  int listenSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listenSocket < 0){
+    error("ERROR opening socket");
+  }
+  unlink(path);         //left behind by an agent that didn't shut down cleanly
+  if (bind(listenSocket, (struct sockaddr*) &address, sizeof(address)) < 0){
+    error("ERROR on binding");
+  }
+  if (listen(listenSocket, LISTEN_BACKLOG) < 0){
+    error("ERROR on listen");
+  }
+  return listenSocket;
+}
+
+int main(int argc, char *argv[]){
+  struct agent agent;
+  memset(&agent, '\0', sizeof(agent));
+  agent.maxWarm = DEFAULT_MAX_WARM;
+  int option;
+  char *end = NULL;
+  while ((option = getopt(argc, argv, "n:")) != -1){
+    switch (option){
+      case 'n':
+        agent.maxWarm = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || agent.maxWarm < 0 || agent.maxWarm > 1024){
+          usage(argv[0]);
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1){
+    usage(argv[0]);
+  }
+  const char *path = argv[optind];
+  setupAddressStruct(&agent.serverAddress, "localhost");
+
+  struct sigaction stop;
+  memset(&stop, '\0', sizeof(stop));
+  stop.sa_handler = requestStop;        //no SA_RESTART: epoll_wait returns and the loop ends
+  sigaction(SIGTERM, &stop, NULL);
+  sigaction(SIGINT, &stop, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  int listenSocket = createListenSocket(path);
+  if ((agent.epollFD = epoll_create1(EPOLL_CLOEXEC)) < 0){
+    error("ERROR creating epoll instance");
+  }
+  struct endpoint listener;
+  memset(&listener, '\0', sizeof(listener));
+  listener.kind = ENDPOINT_LISTENER;
+  listener.fd = listenSocket;
+  if (watchNew(&agent, &listener, EPOLLIN) < 0){
+    error("ERROR registering listening socket");
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  while (!stopRequested){
+    int ready = epoll_wait(agent.epollFD, events, MAX_EVENTS, -1);
+    if (ready < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      error("ERROR on epoll_wait");
+    }
+    for (int i = 0; i < ready; i++){
+      struct endpoint *endpoint = events[i].data.ptr;
+      if (endpoint->fd < 0){          //closed by an earlier event of this wakeup
+        continue;
+      }
+      switch (endpoint->kind){
+        case ENDPOINT_LISTENER:
+          acceptClients(&agent, listenSocket);
+          break;
+        case ENDPOINT_WARM:           //the server closed an idle connection
+          warmRemove(&agent, endpoint->warm);
+          closeEndpoint(&agent, endpoint);
+          break;
+        case ENDPOINT_CLIENT:
+        case ENDPOINT_SERVER:
+          sessionProcess(&agent, endpoint->session, endpoint);
+          break;
+      }
+    }
+    recycleDead(&agent);
+  }
+  close(listenSocket);
+  unlink(path);
+  return 0;
+}
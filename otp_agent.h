@@ -0,0 +1,36 @@
+#ifndef OTP_AGENT_H
+#define OTP_AGENT_H
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* otp_agent is a local daemon that keeps warm connections to the servers on this host, so a
+* client started from a script doesn't pay for resolving "localhost", a TCP connect and a fresh
+* server connection on every run. A client finds the agent through the OTP_AGENT environment
+* variable (the path of its Unix socket) and falls back to connecting by itself when it can't
+* reach it.
+*
+* A client starts with an OTP_AGENT_HELLO_SIZE byte hello and then speaks the binary protocol
+* (otp_protocol.h) exactly as it would to the server:
+*
+*  offset  size  field
+*       0     4  magic        OTP_AGENT_MAGIC (big endian)
+*       4     1  version      OTP_AGENT_VERSION
+*       5     1  (zero)
+*       6     2  port         the server on localhost the requests are for (big endian)
+*
+* The agent relays the requests over a connection to that server, from its pool when it has
+* one. It marks every request keep-alive so the server connection outlives the client, and
+* hangs up on the client once the client's last request is answered, the same way the server
+* would. If the server can't be reached the client gets a single 'f' and the agent hangs up,
+* like a server that refuses the client.
+*/
+
+#define OTP_AGENT_MAGIC 0x4f545041u       // "OTPA"
+#define OTP_AGENT_VERSION 1
+#define OTP_AGENT_HELLO_SIZE 8
+#define OTP_AGENT_ENV "OTP_AGENT"         // where clients look for the agent's socket
+
+#endif
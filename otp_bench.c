@@ -0,0 +1,605 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>      // gethostbyname()
+
+#include <err.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "histogram.h"
+#include "otp_protocol.h"
+#include "otp_random.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* Bench code
+* 1. Fill a key and a text with random characters, as long as the largest message asked for.
+* 2. Start a thread per connection: it sends encryption requests with lengths drawn from the size distribution over
+*    a keep-alive connection, back to back (closed loop) or at its share of the target rate (open loop).
+* 3. Send every ciphertext to the decryption server, it has to come back as the text it was made from.
+* 4. Merge the latency histograms of the threads and print throughput and percentiles.
+* Requests are sent the way the clients send them (streamed above OTP_STREAM_CHUNK), so the numbers are what clients see.
+*/
+
+#define MAX_CONNECTIONS 4096
+#define MAX_SIZE_CLASSES 16
+#define SEND_SEGMENTS 64        // key/text pieces handed to a single sendmsg
+#define DEFAULT_SECONDS 10
+
+// message lengths drawn log-uniformly from [low, high], picked with probability weight / total weight
+struct sizeClass {
+  uint64_t low, high;
+  double weight;
+};
+
+struct bench {
+  const char *encPort, *decPort;          // port numbers or Unix socket paths, decPort NULL: no verification
+  struct sockaddr_in serverAddress;
+  struct sizeClass sizes[MAX_SIZE_CLASSES];
+  int sizeCount;
+  double totalWeight;
+  uint64_t largest;
+  int connections;
+  double rate;                    // requests per second over all connections, 0: closed loop
+  uint64_t maxRequests;           // 0: until the deadline
+  uint64_t issued;                // requests started so far (atomic)
+  long long start, measureFrom, deadline;   // CLOCK_MONOTONIC nanoseconds
+  char *key, *text;
+};
+
+// a keep-alive connection to one of the servers, opened again whenever the server closes it
+struct link {
+  const char *port;
+  int fd;                         // -1 while closed
+};
+
+struct worker {
+  struct bench *bench;
+  pthread_t thread;
+  uint64_t random;                // xorshift64* state for sizes and arrivals
+  struct link enc, dec;
+  char *cipher, *plain;           // results of the current request
+  struct histogram encLatency, decLatency;
+  uint64_t requests, chars, failures;
+  const char *lastFailure;
+  long long finished;
+};
+
+static void error(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+static void usage(const char *program){
+  fprintf(stderr, "USAGE: %s [-c connections] [-d seconds] [-n requests] [-s sizes] [-R rate] [-W warmup_seconds] <enc_port> [<dec_port>]\n", program);
+  fprintf(stderr, "  sizes: size[-size][:weight],... e.g. 100-1G or 1k:90,1M:9,100M:1 (k/M/G suffixes)\n");
+  exit(1);
+}
+
+static long long nowNs(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static uint64_t nextRandom(uint64_t *state){
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dULL;
+}
+
+// uniform in [0, 1)
+static double randomUnit(uint64_t *state){
+  return (nextRandom(state) >> 11) * 0x1.0p-53;
+}
+
+static void setupAddressStruct(struct sockaddr_in* address, char* hostname){
+  memset((char*) address, '\0', sizeof(*address));
+  address->sin_family = AF_INET;
+  struct hostent* hostInfo = gethostbyname(hostname);
+  if (hostInfo == NULL) {
+    fprintf(stderr, "BENCH: ERROR, no such host\n");
+    exit(1);
+  }
+  memcpy((char*) &address->sin_addr.s_addr, hostInfo->h_addr_list[0], hostInfo->h_length);
+}
+
+// a length with an optional k/M/G suffix, returns the character after it (NULL if there is no number)
+static const char *parseSize(const char *text, uint64_t *size){
+  char *end;
+  if (*text < '0' || *text > '9'){
+    return NULL;
+  }
+  *size = strtoull(text, &end, 10);
+  switch (*end){
+    case 'k': case 'K': *size <<= 10; end++; break;
+    case 'M': *size <<= 20; end++; break;
+    case 'G': *size <<= 30; end++; break;
+  }
+  return end;
+}
+
+// size[-size][:weight],... returns -1 if it doesn't parse
+static int parseSizes(struct bench *bench, const char *spec){
+  bench->sizeCount = 0;
+  bench->totalWeight = 0;
+  bench->largest = 0;
+  while (1){
+    if (bench->sizeCount == MAX_SIZE_CLASSES){
+      return -1;
+    }
+    struct sizeClass *class = &bench->sizes[bench->sizeCount++];
+    if ((spec = parseSize(spec, &class->low)) == NULL){
+      return -1;
+    }
+    class->high = class->low;
+    if (*spec == '-' && (spec = parseSize(spec + 1, &class->high)) == NULL){
+      return -1;
+    }
+    class->weight = 1;
+    if (*spec == ':'){
+      char *end;
+      class->weight = strtod(spec + 1, &end);
+      if (end == spec + 1){
+        return -1;
+      }
+      spec = end;
+    }
+    if (class->low == 0 || class->high < class->low || !(class->weight > 0)){
+      return -1;
+    }
+    bench->totalWeight += class->weight;
+    if (class->high > bench->largest){
+      bench->largest = class->high;
+    }
+    if (*spec == '\0'){
+      return 0;
+    }
+    if (*spec++ != ','){
+      return -1;
+    }
+  }
+}
+
+static uint64_t pickSize(struct worker *worker){
+  const struct bench *bench = worker->bench;
+  double pick = randomUnit(&worker->random) * bench->totalWeight;
+  const struct sizeClass *class = &bench->sizes[bench->sizeCount - 1];
+  for (int i = 0; i < bench->sizeCount - 1; i++){
+    if (pick < bench->sizes[i].weight){
+      class = &bench->sizes[i];
+      break;
+    }
+    pick -= bench->sizes[i].weight;
+  }
+  if (class->high == class->low){
+    return class->low;
+  }
+  //log-uniform: as many 100..1k messages as 100M..1G ones
+  double logLow = log((double) class->low), logHigh = log((double) class->high + 1);
+  uint64_t size = (uint64_t) exp(logLow + randomUnit(&worker->random) * (logHigh - logLow));
+  return size < class->low ? class->low : size > class->high ? class->high : size;
+}
+
+// port: a port on localhost or the path of a server's Unix socket, exits if the server can't be reached
+static int connectTo(const struct bench *bench, const char *port){
+  int socketFD;
+  if (strchr(port, '/') != NULL){
+    struct sockaddr_un address;
+    memset(&address, '\0', sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, port, sizeof(address.sun_path) - 1);
+    if (strlen(port) >= sizeof(address.sun_path) || (socketFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+        || connect(socketFD, (struct sockaddr*) &address, sizeof(address)) < 0){
+      fprintf(stderr, "Error: could not contact the server on port %s\n", port);
+      exit(2);
+    }
+  } else {
+    struct sockaddr_in address = bench->serverAddress;
+    address.sin_port = htons(atoi(port));
+    if ((socketFD = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 || connect(socketFD, (struct sockaddr*) &address, sizeof(address)) < 0){
+      fprintf(stderr, "Error: could not contact the server on port %s\n", port);
+      exit(2);
+    }
+    int on = 1;
+    setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));      //small requests shouldn't wait for the previous ACK
+  }
+  fcntl(socketFD, F_SETFL, O_NONBLOCK);
+  return socketFD;
+}
+
+static void closeLink(struct link *link){
+  if (link->fd >= 0){
+    close(link->fd);
+    link->fd = -1;
+  }
+}
+
+// the pieces of the request from byte position on: header, then key and text (chunk by chunk when streamed)
+static int requestSegments(const unsigned char *header, const char *key, const char *text, uint64_t length, uint64_t chunk,
+                           uint64_t position, struct iovec *segments){
+  int count = 0;
+  if (position < OTP_HEADER_SIZE){
+    segments[count].iov_base = (char*) header + position;
+    segments[count++].iov_len = OTP_HEADER_SIZE - position;
+    position = OTP_HEADER_SIZE;
+  }
+  uint64_t body = position - OTP_HEADER_SIZE;
+  while (count < SEND_SEGMENTS && body < 2 * length){
+    uint64_t start = body / (2 * chunk) * chunk;        //the chunk body is in: key[start, start + n) then text[start, start + n)
+    uint64_t n = length - start < chunk ? length - start : chunk;
+    uint64_t within = body - 2 * start;
+    if (within < n){
+      segments[count].iov_base = (char*) key + start + within;
+      segments[count++].iov_len = n - within;
+      body = 2 * start + n;
+    } else {
+      segments[count].iov_base = (char*) text + start + within - n;
+      segments[count++].iov_len = 2 * n - within;
+      body = 2 * (start + n);
+    }
+  }
+  return count;
+}
+
+// send one request over the link and read its whole response into result,
+// returns the status of the response, -1 if the connection broke
+static int exchange(const struct bench *bench, struct link *link, uint32_t magic, const char *key, const char *text,
+                    uint64_t length, char *result){
+  if (link->fd < 0){
+    link->fd = connectTo(bench, link->port);
+  }
+  int streamed = length > OTP_STREAM_CHUNK;
+  struct otpHeader request;
+  memset(&request, '\0', sizeof(request));
+  request.magic = magic;
+  request.version = OTP_PROTOCOL_VERSION;
+  request.flags = OTP_FLAG_KEEPALIVE | (streamed ? OTP_FLAG_STREAM : 0);
+  request.keyLength = length;
+  request.textLength = length;
+  unsigned char header[OTP_HEADER_SIZE];
+  otpEncodeHeader(&request, header);
+  uint64_t chunk = streamed ? OTP_STREAM_CHUNK : length;
+  uint64_t total = OTP_HEADER_SIZE + 2 * length, sent = 0;
+
+  unsigned char frameBytes[OTP_HEADER_SIZE];
+  size_t frameFilled = 0;
+  struct otpHeader frame;
+  uint64_t bodyFilled = 0, bodyLength = 0;
+  while (1){
+    struct pollfd ready = { link->fd, POLLIN | (sent < total ? POLLOUT : 0), 0 };
+    if (poll(&ready, 1, -1) < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      error("BENCH: ERROR on poll");
+    }
+    while (sent < total){
+      struct iovec segments[SEND_SEGMENTS + 1];
+      struct msghdr message;
+      memset(&message, '\0', sizeof(message));
+      message.msg_iov = segments;
+      message.msg_iovlen = requestSegments(header, key, text, length, chunk, sent, segments);
+      ssize_t charsWritten = sendmsg(link->fd, &message, MSG_NOSIGNAL);
+      if (charsWritten < 0){
+        if (errno == EINTR){
+          continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK){
+          break;
+        }
+        closeLink(link);        //EPIPE, ECONNRESET: the server is gone
+        return -1;
+      }
+      sent += charsWritten;
+    }
+    while (1){
+      char *destination;
+      size_t want;
+      if (frameFilled < OTP_HEADER_SIZE){
+        destination = (char*) frameBytes + frameFilled;
+        want = OTP_HEADER_SIZE - frameFilled;
+      } else {
+        destination = result + frame.keyLength + bodyFilled;
+        want = bodyLength - bodyFilled;
+      }
+      ssize_t charsRead = want == 0 ? 0 : recv(link->fd, destination, want, 0);
+      if (charsRead < 0 && errno == EINTR){
+        continue;
+      }
+      if (charsRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+        break;
+      }
+      if (charsRead <= 0 && want > 0){        //hung up (or reset) before the response was complete
+        closeLink(link);
+        return -1;
+      }
+      if (frameFilled < OTP_HEADER_SIZE){
+        frameFilled += charsRead;
+        if (frameFilled < OTP_HEADER_SIZE){
+          continue;
+        }
+        if (otpDecodeHeader(frameBytes, &frame) < 0 || frame.magic != OTP_MAGIC_RESULT){
+          closeLink(link);
+          return -1;
+        }
+        if (frame.status != OTP_STATUS_OK){       //nothing follows that we could use
+          closeLink(link);
+          return frame.status;
+        }
+        if (frame.keyLength > length || frame.textLength > length - frame.keyLength){
+          closeLink(link);
+          return -1;
+        }
+        bodyLength = otpResponseBodyLength(&frame);
+        bodyFilled = 0;
+      } else {
+        bodyFilled += charsRead;
+      }
+      if (bodyFilled < bodyLength){
+        continue;
+      }
+      if (!(frame.flags & OTP_FLAG_MORE)){      //the whole result is in
+        if (!(frame.flags & OTP_FLAG_KEEPALIVE)){       //e.g. -r max_requests, the next request needs a new connection
+          closeLink(link);
+        }
+        return OTP_STATUS_OK;
+      }
+      frameFilled = 0;
+    }
+  }
+}
+
+static const char *describeFailure(int status){
+  return status < 0 ? "connection lost" : otpStatusText(status);
+}
+
+static void *runWorker(void *argument){
+  struct worker *worker = argument;
+  struct bench *bench = worker->bench;
+  //open loop: Poisson arrivals at this connection's share of the rate, latency counts from when a request was due,
+  //so a server that falls behind pays for the whole queue and not just for the request it finally gets to
+  double meanGap = bench->rate > 0 ? bench->connections / bench->rate * 1e9 : 0;
+  long long due = bench->start;
+  while (1){
+    if (bench->maxRequests != 0 && __atomic_fetch_add(&bench->issued, 1, __ATOMIC_RELAXED) >= bench->maxRequests){
+      break;
+    }
+    long long started = nowNs();
+    if (meanGap > 0){
+      due += (long long) (-log(1 - randomUnit(&worker->random)) * meanGap);
+      if (due >= bench->deadline){
+        break;
+      }
+      struct timespec wake = { due / 1000000000LL, due % 1000000000LL };
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR){
+      }
+      started = due;
+    } else if (started >= bench->deadline){
+      break;
+    }
+    uint64_t length = pickSize(worker);
+    int status = exchange(bench, &worker->enc, OTP_MAGIC_ENCRYPT, bench->key, bench->text, length, worker->cipher);
+    long long encrypted = nowNs(), decrypted = encrypted;
+    if (status == OTP_STATUS_OK && bench->decPort != NULL){
+      status = exchange(bench, &worker->dec, OTP_MAGIC_DECRYPT, bench->key, worker->cipher, length, worker->plain);
+      decrypted = nowNs();
+      if (status == OTP_STATUS_OK && memcmp(worker->plain, bench->text, length) != 0){
+        worker->failures++;
+        worker->lastFailure = "the decrypted text differs from the original";
+        continue;
+      }
+    }
+    if (status != OTP_STATUS_OK){
+      worker->failures++;
+      worker->lastFailure = describeFailure(status);
+      continue;
+    }
+    if (started >= bench->measureFrom){
+      histogramRecord(&worker->encLatency, encrypted - started);
+      if (bench->decPort != NULL){
+        histogramRecord(&worker->decLatency, decrypted - encrypted);
+      }
+      worker->requests++;
+      worker->chars += length;
+    }
+  }
+  worker->finished = nowNs();
+  closeLink(&worker->enc);
+  closeLink(&worker->dec);
+  return NULL;
+}
+
+static void printDuration(double ns){
+  if (ns < 1e3){
+    printf("%8.0f ns", ns);
+  } else if (ns < 1e6){
+    printf("%8.1f us", ns / 1e3);
+  } else if (ns < 1e9){
+    printf("%8.2f ms", ns / 1e6);
+  } else {
+    printf("%8.3f s ", ns / 1e9);
+  }
+}
+
+static void printLatency(const char *name, const struct histogram *histogram){
+  printf("%-10s", name);
+  static const double percentiles[] = { 50, 99, 99.9 };
+  static const char *labels[] = { "p50", "p99", "p999" };
+  for (int i = 0; i < 3; i++){
+    printf("  %s", labels[i]);
+    printDuration(histogramPercentile(histogram, percentiles[i]));
+  }
+  printf("  max");
+  printDuration(histogram->max);
+  printf("  mean");
+  printDuration(histogram->total > 0 ? (double) histogram->sum / histogram->total : 0);
+  printf("\n");
+}
+
+int main(int argc, char *argv[]){
+  struct bench bench;
+  memset(&bench, '\0', sizeof(bench));
+  bench.connections = 1;
+  double seconds = -1, warmup = 0;
+  const char *sizeSpec = "1k";
+  int option;
+  char *end = NULL;
+  while ((option = getopt(argc, argv, "c:d:n:s:R:W:")) != -1){
+    switch (option){
+      case 'c':
+        bench.connections = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || bench.connections < 1 || bench.connections > MAX_CONNECTIONS){
+          usage(argv[0]);
+        }
+        break;
+      case 'd':
+        seconds = strtod(optarg, &end);
+        if (end == optarg || *end != '\0' || !(seconds > 0)){
+          usage(argv[0]);
+        }
+        break;
+      case 'n':
+        bench.maxRequests = strtoull(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || bench.maxRequests == 0){
+          usage(argv[0]);
+        }
+        break;
+      case 's':
+        sizeSpec = optarg;
+        break;
+      case 'R':
+        bench.rate = strtod(optarg, &end);
+        if (end == optarg || *end != '\0' || !(bench.rate > 0)){
+          usage(argv[0]);
+        }
+        break;
+      case 'W':
+        warmup = strtod(optarg, &end);
+        if (end == optarg || *end != '\0' || !(warmup >= 0)){
+          usage(argv[0]);
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 && optind != argc - 2){
+    usage(argv[0]);
+  }
+  if (parseSizes(&bench, sizeSpec) < 0){
+    fprintf(stderr, "%s: bad size distribution %s\n", argv[0], sizeSpec);
+    usage(argv[0]);
+  }
+  if (seconds < 0){
+    seconds = bench.maxRequests != 0 ? 0 : DEFAULT_SECONDS;     //-n alone runs until that many requests are done
+  }
+  bench.encPort = argv[optind];
+  bench.decPort = optind + 1 < argc ? argv[optind + 1] : NULL;
+  setupAddressStruct(&bench.serverAddress, "localhost");
+  signal(SIGPIPE, SIG_IGN);
+
+  //one key and one text as long as the largest message, every request uses their beginning
+  unsigned char seed[OTP_RANDOM_KEY_SIZE];
+  if (otpRandomKey(seed) < 0){
+    error("BENCH: ERROR getting entropy");
+  }
+  struct otpRandom random;
+  if ((bench.key = malloc(bench.largest)) == NULL || (bench.text = malloc(bench.largest)) == NULL){
+    error("BENCH: ERROR allocating the messages");
+  }
+  otpRandomInit(&random, seed, 0);
+  otpRandomText(&random, bench.key, bench.largest);
+  otpRandomInit(&random, seed, 1);
+  otpRandomText(&random, bench.text, bench.largest);
+
+  struct worker *workers = calloc(bench.connections, sizeof(struct worker));
+  if (workers == NULL){
+    error("BENCH: ERROR allocating the workers");
+  }
+  for (int i = 0; i < bench.connections; i++){
+    struct worker *worker = &workers[i];
+    worker->bench = &bench;
+    memcpy(&worker->random, seed, sizeof(worker->random));
+    worker->random ^= 0x9e3779b97f4a7c15ULL * (i + 1);
+    worker->random |= 1;
+    worker->enc.port = bench.encPort;
+    worker->dec.port = bench.decPort;
+    //connect up front, so the first requests don't include the handshake and a wrong port shows at once
+    worker->enc.fd = connectTo(&bench, bench.encPort);
+    worker->dec.fd = bench.decPort != NULL ? connectTo(&bench, bench.decPort) : -1;
+    if ((worker->cipher = malloc(bench.largest)) == NULL || (bench.decPort != NULL && (worker->plain = malloc(bench.largest)) == NULL)){
+      error("BENCH: ERROR allocating the results");
+    }
+  }
+
+  bench.start = nowNs();
+  bench.measureFrom = bench.start + (long long) (warmup * 1e9);
+  bench.deadline = seconds > 0 ? bench.measureFrom + (long long) (seconds * 1e9) : INT64_MAX;
+  for (int i = 0; i < bench.connections; i++){
+    if (pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]) != 0){
+      error("BENCH: ERROR starting a worker thread");
+    }
+  }
+
+  struct histogram *encLatency = calloc(1, sizeof(struct histogram));
+  struct histogram *decLatency = calloc(1, sizeof(struct histogram));
+  uint64_t requests = 0, chars = 0, failures = 0;
+  const char *lastFailure = NULL;
+  long long finished = bench.measureFrom;
+  for (int i = 0; i < bench.connections; i++){
+    pthread_join(workers[i].thread, NULL);
+    histogramMerge(encLatency, &workers[i].encLatency);
+    histogramMerge(decLatency, &workers[i].decLatency);
+    requests += workers[i].requests;
+    chars += workers[i].chars;
+    failures += workers[i].failures;
+    if (workers[i].lastFailure != NULL){
+      lastFailure = workers[i].lastFailure;
+    }
+    if (workers[i].finished > finished){
+      finished = workers[i].finished;
+    }
+  }
+  double elapsed = (finished - bench.measureFrom) / 1e9;
+  if (elapsed <= 0){
+    elapsed = 1e-9;
+  }
+
+  printf("%d connection%s, %s", bench.connections, bench.connections == 1 ? "" : "s", bench.rate > 0 ? "open loop" : "closed loop");
+  if (bench.rate > 0){
+    printf(" at %.0f requests/s", bench.rate);
+  }
+  printf(", sizes %s, %s\n", sizeSpec, bench.decPort != NULL ? "every ciphertext decrypted and compared" : "not verified");
+  printf("requests  %llu in %.2f s, %.1f/s, %llu failed", (unsigned long long) requests, elapsed, requests / elapsed,
+         (unsigned long long) failures);
+  if (lastFailure != NULL){
+    printf(" (%s)", lastFailure);
+  }
+  printf("\n");
+  printf("text      %.1f MB/s encrypted\n", chars / elapsed / 1e6);
+  printLatency("encrypt", encLatency);
+  if (bench.decPort != NULL){
+    printLatency("decrypt", decLatency);
+  }
+  return failures != 0 ? 1 : 0;
+}
@@ -0,0 +1,778 @@
+#define _GNU_SOURCE             // memfd_create(), F_ADD_SEALS
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>  // ssize_t
+#include <sys/socket.h> // send(),recv()
+#include <sys/un.h>     // struct sockaddr_un
+#include <sys/uio.h>    // struct iovec
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <signal.h>
+#include <netdb.h>      // gethostbyname()
+#include <errno.h>
+#include <err.h>
+#include <stdint.h>
+
+#include "otp_client.h"
+#include "otp_protocol.h"
+#include "otp_agent.h"
+#include "otp_kernel.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+// YOU CAN UNCOMMENT ALL THE PRINTFs TO TEST THE CLIENT-SERVER INTERACTION FLOW
+
+#define MAX_SEND_PARTS 1024     // iovecs handed to a single sendmsg (IOV_MAX on Linux)
+#define SENDFILE_MIN 16384      // shorter parts of a file are gathered into a sendmsg instead
+
+// Error function used for reporting issues
+static void error(const char *msg) {
+  perror(msg);
+  exit(0);
+}
+
+// Set up the address struct
+static void setupAddressStruct(struct sockaddr_in* address,
+                               int portNumber,
+                               char* hostname){
+
+  // Clear out the address struct
+  memset((char*) address, '\0', sizeof(*address));
+
+  // The address should be network capable
+  address->sin_family = AF_INET;
+  // Store the port number
+  address->sin_port = htons(portNumber);
+
+  // Get the DNS entry for this host name
+  struct hostent* hostInfo = gethostbyname(hostname);
+  if (hostInfo == NULL) {
+    fprintf(stderr, "CLIENT: ERROR, no such host\n");
+    exit(0);
+  }
+  // Copy the first IP address from the DNS entry to sin_addr.s_addr
+  memcpy((char*) &address->sin_addr.s_addr,
+        hostInfo->h_addr_list[0],
+        hostInfo->h_length);
+}
+
+// Map a file into memory, the request is sent straight from the mapping. Only the first line counts,
+// its length (without the \n) is stored in length and the size of the mapping in mapped.
+// The text is mapped copy-on-write so the result can replace it without touching the file.
+// The file stays open in fd, long ranges of it are sent with sendfile().
+static char *readInputFile(const char *path, size_t *length, size_t *mapped, int *fd, int writable){
+  *fd = open(path, O_RDONLY);
+  if (*fd < 0) {                    // check if file opening fails
+    err(errno, "open()");
+  }
+  struct stat info;
+  if (fstat(*fd, &info) < 0){
+    err(errno, "fstat()");
+  }
+  *mapped = info.st_size;
+  if (*mapped == 0){                //nothing to map, an empty line
+    *length = 0;
+    return NULL;
+  }
+  char *data = mmap(NULL, *mapped, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, *fd, 0);
+  if (data == MAP_FAILED){
+    err(errno, "mmap()");
+  }
+  madvise(data, *mapped, MADV_SEQUENTIAL);
+
+  const char *newline = memchr(data, '\n', *mapped);    //cut a \n
+  *length = newline != NULL ? (size_t) (newline - data) : *mapped;
+  return data;
+}
+
+// one <plaintext> <key> pair, the text is replaced by the result as its response arrives
+struct pipelinedRequest {
+  char *text;                 // mapped copy-on-write
+  char *key;                  // mapped read-only
+  size_t length;              // chars of the text (only that many key chars are sent)
+  size_t textMapped, keyMapped;
+  int textFD, keyFD;          // the files, for sendfile()
+  int padded;                 // the key is a segment of a pad kept by the server ("pad:<id>[@<offset>]")
+  uint32_t padId;
+  uint64_t padOffset;         // OTP_PAD_OFFSET_ANY until the server tells which segment it used
+  int packed;                 // sent packed: text and key as symbols, 3 in 2 bytes (OTP_FLAG_PACKED)
+  char *packedText;           // the packed text, replaced by the packed result as it arrives
+  char *packedKey;
+  int shared;                 // key and text are in the region shared with the server, the result replaces the text there
+  uint64_t sharedKey, sharedText;         // their offsets in the region
+  unsigned char sharedBody[OTP_SHARED_BODY_SIZE];
+  int done;                   // the whole result is here
+  int overwritten;            // part of a result replaced the text, it is restored before the text is sent again
+};
+
+// "pad:<id>" or "pad:<id>@<offset>" instead of a key file names a pad kept by the server, returns 1 if path is one
+static int parsePadKey(const char *path, struct pipelinedRequest *request){
+  if (strncmp(path, "pad:", 4) != 0){
+    return 0;
+  }
+  char *end = NULL;
+  unsigned long id = strtoul(path + 4, &end, 10);
+  if (end == path + 4 || (*end != '\0' && *end != '@')){
+    return 0;
+  }
+  uint64_t offset = OTP_PAD_OFFSET_ANY;         //the encryption server picks an unused segment
+  if (*end == '@'){
+    const char *digits = end + 1;
+    offset = strtoull(digits, &end, 10);
+    if (end == digits || *end != '\0'){
+      return 0;
+    }
+  }
+  request->padded = 1;
+  request->padId = id;
+  request->padOffset = offset;
+  return 1;
+}
+
+// map a text/key pair and make sure they can be sent: exits with 1 if the key is too short or either has bad characters
+static void readRequestFiles(const char *textPath, const char *keyPath, struct pipelinedRequest *request,
+                             const char *program, const struct otpClientProfile *profile){
+  size_t textLength, keyLength;
+  char *plaintextBuffer = readInputFile(textPath, &textLength, &request->textMapped, &request->textFD, 1);    // map the text file
+  char *key = NULL;
+  if (parsePadKey(keyPath, request)){       //the server has the key and checked it when it loaded the pad
+    keyLength = 0;
+    request->keyFD = -1;
+  } else {
+    key = readInputFile(keyPath, &keyLength, &request->keyMapped, &request->keyFD, 0);                  // map the key file
+  }
+
+  /*------------------------------------------------------------------------------------------------------------*/
+  // If the client receives key or plaintext files with ANY bad characters in them, or the key file is shorter
+  // than the plaintext, then it terminates, sends appropriate error text to stderr, and sets the exit value to 1.
+
+  //check if key is smaller than text
+  if(textLength > keyLength && !request->padded){
+    fprintf(stderr, "ERROR: %s provide longer <key> \n", program);
+    exit(1);
+  }
+
+  //check for problematic chars, one sweep over the text and one over the key
+  size_t invalid = otpFindInvalid(plaintextBuffer, textLength);
+  if (invalid < textLength){
+    fprintf(stderr, "ERROR: %s %s has invalid characters in it (offset %zu)! \n", program, profile->textDescription, invalid);
+    exit(1);
+  }
+  invalid = otpFindInvalid(key, keyLength);
+  if (invalid < keyLength){
+    fprintf(stderr, "ERROR: %s <key> file has invalid characters in it (offset %zu)! \n", program, invalid);
+    exit(1);
+  }
+  request->text = plaintextBuffer;
+  request->key = key;
+  request->length = textLength;
+}
+
+//if the client cannot connect to its server, for any reason (including that it has accidentally tried to connect to the
+//other server), it reports this error to stderr with the attempted port, and set the exit value to 2.
+static void connectionFailed(const char *program, const char *port){
+  fprintf(stderr, "Failure! Server connection failed! Could not contact %s on port %s \n", program, port);
+  exit(2);
+}
+
+// Hand the requests to a local otp_agent (otp_agent.h), which has a warm connection to the server, -1 if it isn't running
+static int connectToAgent(const char *agentPath, int portNumber){
+  struct sockaddr_un address;
+  memset(&address, '\0', sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(agentPath) >= sizeof(address.sun_path)){
+    return -1;
+  }
+  strcpy(address.sun_path, agentPath);
+  int socketFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (socketFD < 0){
+    return -1;
+  }
+  unsigned char hello[OTP_AGENT_HELLO_SIZE] = {
+    (OTP_AGENT_MAGIC >> 24) & 0xff, (OTP_AGENT_MAGIC >> 16) & 0xff, (OTP_AGENT_MAGIC >> 8) & 0xff, OTP_AGENT_MAGIC & 0xff,
+    OTP_AGENT_VERSION, 0, (portNumber >> 8) & 0xff, portNumber & 0xff
+  };
+  if (connect(socketFD, (struct sockaddr*) &address, sizeof(address)) < 0
+      || send(socketFD, hello, OTP_AGENT_HELLO_SIZE, MSG_NOSIGNAL) != OTP_AGENT_HELLO_SIZE){
+    close(socketFD);
+    return -1;
+  }
+  return socketFD;
+}
+
+// a port with a '/' in it is the path of a server's Unix socket (its -u)
+static int isLocalPath(const char *port){
+  return strchr(port, '/') != NULL;
+}
+
+static int connectToLocal(const char *program, const char *port){
+  struct sockaddr_un address;
+  memset(&address, '\0', sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(port) >= sizeof(address.sun_path)){
+    connectionFailed(program, port);
+  }
+  strcpy(address.sun_path, port);
+  int socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socketFD < 0){
+    error("CLIENT: ERROR opening socket");
+  }
+  if (connect(socketFD, (struct sockaddr*) &address, sizeof(address)) < 0){
+    connectionFailed(program, port);
+  }
+  return socketFD;
+}
+
+// Connect to the server's Unix socket, or through the agent if there is one, otherwise to the server on localhost (resolved on first use)
+static int connectToServer(struct sockaddr_in *serverAddress, int *resolved, const char *agentPath,
+                           const char *program, const char *port){
+  if (isLocalPath(port)){
+    return connectToLocal(program, port);
+  }
+  int portNumber = atoi(port);
+  if (agentPath != NULL){
+    int socketFD = connectToAgent(agentPath, portNumber);
+    if (socketFD >= 0){
+      return socketFD;
+    }
+  }
+  if (!*resolved){
+    // Set up the server address struct, pass port number, our 3rd argument
+    setupAddressStruct(serverAddress, portNumber, "localhost");
+    *resolved = 1;
+  }
+  // Create a socket
+  int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+  if (socketFD < 0){
+    error("CLIENT: ERROR opening socket");
+  }
+  if (connect(socketFD, (struct sockaddr*) serverAddress, sizeof(*serverAddress)) < 0){
+    connectionFailed(program, port);
+  }
+  return socketFD;
+}
+
+// a response frame being received
+struct frameReader {
+  unsigned char header[OTP_HEADER_SIZE];
+  size_t headerFilled;
+  struct otpHeader frame;
+  size_t bodyLength;          // result bytes following the header (fewer than chars when packed)
+  size_t bodyFilled;          // result bytes of this frame received so far
+};
+
+// a piece of the requests to send: bytes in memory, or a range of an input file that goes out with sendfile()
+struct sendPart {
+  const char *data;
+  int fd;                     // -1 to send data from memory
+  off_t offset;               // where data starts in the file
+  size_t length;
+};
+
+// send the parts without blocking, returns how many parts are left, -1 if the server closed.
+// File ranges go from the page cache to the socket with sendfile(), consecutive parts in memory
+// (headers, short key/text) are gathered into one sendmsg().
+static int sendSome(int socketFD, struct sendPart **parts, int count){
+  while (count > 0){
+    ssize_t charsWritten;
+    if ((*parts)->fd >= 0){
+      off_t offset = (*parts)->offset;
+      charsWritten = sendfile(socketFD, (*parts)->fd, &offset, (*parts)->length);
+    } else {
+      struct iovec gathered[MAX_SEND_PARTS];
+      int gatheredCount = 0;
+      while (gatheredCount < count && gatheredCount < MAX_SEND_PARTS && (*parts)[gatheredCount].fd < 0){
+        gathered[gatheredCount].iov_base = (char*) (*parts)[gatheredCount].data;
+        gathered[gatheredCount].iov_len = (*parts)[gatheredCount].length;
+        gatheredCount++;
+      }
+      struct msghdr message;
+      memset(&message, '\0', sizeof(message));
+      message.msg_iov = gathered;
+      message.msg_iovlen = gatheredCount;
+      //a file range follows right away, let the kernel put the header in the same segment
+      charsWritten = sendmsg(socketFD, &message, MSG_NOSIGNAL | (gatheredCount < count ? MSG_MORE : 0));
+    }
+    if (charsWritten < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK){
+        return count;
+      }
+      if (errno == EPIPE || errno == ECONNRESET){     //the server stopped taking requests, what it answered is still readable
+        return -1;
+      }
+      error("CLIENT: ERROR writing to socket");
+    }
+    while (count > 0 && (size_t) charsWritten >= (*parts)->length){     //skip the parts that are completely sent
+      charsWritten -= (*parts)->length;
+      (*parts)++;
+      count--;
+    }
+    if (count > 0){
+      (*parts)->data += charsWritten;
+      (*parts)->offset += charsWritten;
+      (*parts)->length -= charsWritten;
+    }
+  }
+  return 0;
+}
+
+// the server didn't answer what it was asked
+static void resultFailed(void){
+  fprintf(stderr, "Failure! Reading the result failed! \n");
+  exit(1);
+}
+
+// check a response header, exits if the server refused the request or the frame doesn't fit it
+static void checkFrame(struct frameReader *reader, struct pipelinedRequest *requests, int count,
+                       const char *program, const char *port){
+  struct otpHeader *frame = &reader->frame;
+  if (otpDecodeHeader(reader->header, frame) < 0 || frame->magic != OTP_MAGIC_RESULT){
+    resultFailed();
+  }
+  if (frame->status == OTP_STATUS_WRONG_SERVER){        //e.g. enc_client connected to dec_server
+    connectionFailed(program, port);
+  }
+  if (frame->status != OTP_STATUS_OK){
+    fprintf(stderr, "Failure! Server refused the request: %s \n", otpStatusText(frame->status));
+    exit(1);
+  }
+  if (frame->requestId >= (uint32_t) count || requests[frame->requestId].done){
+    resultFailed();
+  }
+  struct pipelinedRequest *request = &requests[frame->requestId];
+  reader->bodyLength = 0;
+  if (frame->flags & OTP_FLAG_PAD){       //no result bytes, just the pad segment the server used
+    if (frame->textLength != 0){
+      resultFailed();
+    }
+    request->padOffset = frame->keyLength;
+    return;
+  }
+  //the result has exactly the length of the text, its fragments go right where the text was
+  if (frame->keyLength > request->length || frame->textLength > request->length - frame->keyLength){
+    resultFailed();
+  }
+  reader->bodyLength = frame->textLength;
+  if (request->packed){       //packed fragments cover whole groups of 3, only the very last one may end early
+    if (frame->keyLength % 3 != 0 || (frame->textLength % 3 != 0 && frame->keyLength + frame->textLength != request->length)){
+      resultFailed();
+    }
+    reader->bodyLength = OTP_PACKED_SIZE(frame->textLength);
+  }
+  if (request->shared){       //the result is in the region already
+    reader->bodyLength = 0;
+  }
+}
+
+// read whatever response bytes have arrived, returns 0 while the connection is open, -1 once the server hung up
+static int receiveSome(int socketFD, struct frameReader *reader, struct pipelinedRequest *requests, int count,
+                       const char *program, const char *port){
+  while (1){
+    char *destination;
+    size_t want;
+    if (reader->headerFilled < OTP_HEADER_SIZE){
+      destination = (char*) reader->header + reader->headerFilled;
+      want = OTP_HEADER_SIZE - reader->headerFilled;
+    } else {
+      struct pipelinedRequest *request = &requests[reader->frame.requestId];
+      destination = request->packed ? request->packedText + OTP_PACKED_SIZE(reader->frame.keyLength)
+                                    : request->text + reader->frame.keyLength;
+      destination += reader->bodyFilled;
+      want = reader->bodyLength - reader->bodyFilled;
+    }
+    ssize_t charsRead = want == 0 ? 0 : recv(socketFD, destination, want, 0);
+    if (charsRead < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK){
+        return 0;
+      }
+      if (errno != ECONNRESET){
+        error("CLIENT: ERROR reading from socket");
+      }
+    }
+    if (charsRead <= 0 && want > 0){        //the server hung up
+      if (reader->headerFilled >= 1 && reader->header[0] == 'f'){      //a server that only speaks the old protocol, or the wrong one of them
+        connectionFailed(program, port);
+      }
+      if (reader->headerFilled > 0){        //in the middle of a frame
+        resultFailed();
+      }
+      return -1;
+    }
+    if (reader->headerFilled < OTP_HEADER_SIZE){
+      reader->headerFilled += charsRead;
+      if (reader->headerFilled == OTP_HEADER_SIZE){
+        checkFrame(reader, requests, count, program, port);
+        reader->bodyFilled = 0;
+      }
+      if (reader->headerFilled < OTP_HEADER_SIZE || reader->bodyLength > 0){
+        continue;
+      }
+    } else {
+      reader->bodyFilled += charsRead;
+      requests[reader->frame.requestId].overwritten = 1;
+      if (reader->bodyFilled < reader->bodyLength){
+        continue;
+      }
+    }
+    //the frame is complete, the next one starts with a header
+    if (!(reader->frame.flags & OTP_FLAG_MORE)){
+      requests[reader->frame.requestId].done = 1;
+    }
+    reader->headerFilled = 0;
+  }
+}
+
+// queue a part of a request, long ranges of a file are sent with sendfile(), the rest from memory
+static void addPart(struct sendPart *parts, int *partCount, const char *data, int fd, off_t offset, size_t length){
+  if (length == 0){
+    return;
+  }
+  parts[*partCount].data = data;
+  parts[*partCount].fd = length >= SENDFILE_MIN ? fd : -1;
+  parts[*partCount].offset = offset;
+  parts[*partCount].length = length;
+  (*partCount)++;
+}
+
+// Find out whether the server takes requests with the flags (packed, shared): send an empty one and wait for its answer
+// before anything else goes out (a server that doesn't know the flag would skip the wrong number of body bytes).
+// passFD goes along with the header (-1: none). Returns the status of the answer, *keepsOpen tells whether the
+// server takes more requests on this connection.
+static int probeServer(int socketFD, int flags, int passFD, int *keepsOpen, const char *program, const char *port,
+                       const struct otpClientProfile *profile){
+  struct otpHeader probe;
+  unsigned char buffer[OTP_HEADER_SIZE];
+  memset(&probe, '\0', sizeof(probe));
+  probe.magic = profile->magic;
+  probe.version = OTP_PROTOCOL_VERSION;
+  probe.flags = flags | OTP_FLAG_KEEPALIVE;
+  otpEncodeHeader(&probe, buffer);
+  struct iovec vector = { buffer, OTP_HEADER_SIZE };
+  union {
+    struct cmsghdr align;
+    char space[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr message;
+  memset(&message, '\0', sizeof(message));
+  message.msg_iov = &vector;
+  message.msg_iovlen = 1;
+  if (passFD >= 0){           //the descriptor arrives together with the first byte of the header
+    memset(&control, '\0', sizeof(control));
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+    struct cmsghdr *rights = CMSG_FIRSTHDR(&message);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(rights), &passFD, sizeof(int));
+  }
+  if (sendmsg(socketFD, &message, MSG_NOSIGNAL) != OTP_HEADER_SIZE){
+    connectionFailed(program, port);
+  }
+  size_t filled = 0;
+  while (filled < OTP_HEADER_SIZE){
+    ssize_t charsRead = recv(socketFD, buffer + filled, OTP_HEADER_SIZE - filled, 0);
+    if (charsRead < 0 && errno == EINTR){
+      continue;
+    }
+    if (charsRead <= 0){
+      if (filled >= 1 && buffer[0] == 'f'){      //a server that only speaks the old protocol, or the wrong one of them
+        connectionFailed(program, port);
+      }
+      resultFailed();
+    }
+    filled += charsRead;
+  }
+  if (otpDecodeHeader(buffer, &probe) < 0 || probe.magic != OTP_MAGIC_RESULT){
+    resultFailed();
+  }
+  if (probe.status == OTP_STATUS_WRONG_SERVER){
+    connectionFailed(program, port);
+  }
+  *keepsOpen = (probe.flags & OTP_FLAG_KEEPALIVE) != 0;
+  return probe.status;
+}
+
+// Copy the key and the text of every request into one sealed memfd that the server maps too (OTP_WIRE=shared on a
+// Unix socket). The server transforms the texts right there, nothing but headers and offsets goes over the socket.
+// Returns the region, NULL if there is nothing to share or no memfd.
+static char *createRegion(struct pipelinedRequest *requests, int count, size_t *size, int *regionFD){
+  *size = 0;
+  for (int i = 0; i < count; i++){
+    requests[i].sharedKey = *size;
+    *size += requests[i].padded ? 0 : requests[i].length;
+    requests[i].sharedText = *size;
+    *size += requests[i].length;
+  }
+  if (*size == 0){
+    return NULL;
+  }
+  *regionFD = memfd_create("otp-region", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (*regionFD < 0){
+    return NULL;
+  }
+  char *region = MAP_FAILED;
+  if (ftruncate(*regionFD, *size) < 0 || fcntl(*regionFD, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0
+      || (region = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, *regionFD, 0)) == MAP_FAILED){
+    close(*regionFD);
+    return NULL;
+  }
+  for (int i = 0; i < count; i++){
+    if (!requests[i].padded){
+      memcpy(region + requests[i].sharedKey, requests[i].key, requests[i].length);
+    }
+    memcpy(region + requests[i].sharedText, requests[i].text, requests[i].length);
+  }
+  return region;
+}
+
+// Put the original text back where a connection that closed in the middle of a result left part of it,
+// so the request goes again as it was. Packed and shared results never touch the mapped text, plain ones go over it.
+static void restoreText(struct pipelinedRequest *request, char *region){
+  if (request->shared){
+    memcpy(region + request->sharedText, request->text, request->length);
+  } else if (request->packed){
+    otpTextToSymbols(request->packedText, request->text, request->length);
+    otpPack(request->packedText, request->length);
+  } else if (request->textMapped > 0){      //private pages are dropped, the file's own bytes come back
+    madvise(request->text, request->textMapped, MADV_DONTNEED);
+  }
+  request->overwritten = 0;
+}
+
+// convert the text and key of every request into packed symbols, kept next to the mappings
+static void packRequests(struct pipelinedRequest *requests, int count){
+  for (int i = 0; i < count; i++){
+    struct pipelinedRequest *request = &requests[i];
+    request->packed = 1;
+    if (request->length == 0){
+      continue;
+    }
+    //length + 1: room to unpack the result in place again
+    if ((request->packedText = malloc(request->length + 1)) == NULL
+        || (!request->padded && (request->packedKey = malloc(request->length + 1)) == NULL)){
+      error("CLIENT: ERROR allocating requests");
+    }
+    otpTextToSymbols(request->packedText, request->text, request->length);
+    otpPack(request->packedText, request->length);
+    if (!request->padded){
+      otpTextToSymbols(request->packedKey, request->key, request->length);
+      otpPack(request->packedKey, request->length);
+    }
+  }
+}
+
+// Send every unfinished request over one connection without waiting for the responses, and
+// read the responses while sending. Results may arrive in any order and in fragments.
+// Returns how many results arrived before the server closed the connection.
+static int pipelineRequests(int socketFD, struct pipelinedRequest *requests, int count,
+                            const char *program, const char *port, const struct otpClientProfile *profile){
+  int pending = 0;
+  size_t maxParts = 0;
+  for (int i = 0; i < count; i++){
+    pending += !requests[i].done;
+    maxParts += requests[i].done ? 0 : 1 + 2 * (requests[i].length / OTP_PACKED_STREAM_CHUNK + 1);
+  }
+  unsigned char (*headers)[OTP_HEADER_SIZE] = malloc(pending * OTP_HEADER_SIZE);
+  struct sendPart *parts = malloc(maxParts * sizeof(struct sendPart));
+  if (headers == NULL || parts == NULL){
+    error("CLIENT: ERROR allocating requests");
+  }
+  //header, the part of the key that covers the text, and the text of every request, no acknowledgements.
+  //Anything larger than a stream chunk is streamed, so the server can send its result back while we are still sending.
+  int partCount = 0, queued = 0;
+  for (int i = 0; i < count; i++){
+    if (requests[i].done){
+      continue;
+    }
+    struct otpHeader request;
+    memset(&request, '\0', sizeof(request));
+    request.magic = profile->magic;
+    request.version = OTP_PROTOCOL_VERSION;
+    int streamed = requests[i].length > OTP_STREAM_CHUNK && !requests[i].shared;
+    request.flags = OTP_FLAG_MULTIPLEX | (streamed ? OTP_FLAG_STREAM : 0) | (++queued < pending ? OTP_FLAG_KEEPALIVE : 0)
+                    | (requests[i].packed ? OTP_FLAG_PACKED : 0) | (requests[i].shared ? OTP_FLAG_SHARED : 0);
+    request.requestId = i;
+    request.keyLength = requests[i].length;     //the server never needs more key than text
+    request.textLength = requests[i].length;
+    if (requests[i].padded){                    //no key on the wire, just where the server finds it
+      request.flags |= OTP_FLAG_PAD;
+      request.padId = requests[i].padId;
+      request.keyLength = requests[i].padOffset;
+    }
+    otpEncodeHeader(&request, headers[queued - 1]);
+    addPart(parts, &partCount, (char*) headers[queued - 1], -1, 0, OTP_HEADER_SIZE);
+    if (requests[i].shared){      //just where key and text are, the server transforms the text there
+      requests[i].overwritten = 1;
+      otpEncodeSharedBody(requests[i].sharedKey, requests[i].sharedText, requests[i].sharedBody);
+      addPart(parts, &partCount, (char*) requests[i].sharedBody, -1, 0, OTP_SHARED_BODY_SIZE);
+      continue;
+    }
+    size_t chunk = !streamed ? requests[i].length : requests[i].packed ? OTP_PACKED_STREAM_CHUNK : OTP_STREAM_CHUNK;
+    size_t offset = 0;
+    do {          //key bytes of a chunk, then its text bytes (a single chunk when not streamed)
+      size_t length = requests[i].length - offset < chunk ? requests[i].length - offset : chunk;
+      if (requests[i].packed){        //packed chunks go from memory, the files hold characters
+        if (!requests[i].padded){
+          addPart(parts, &partCount, requests[i].packedKey + OTP_PACKED_SIZE(offset), -1, 0, OTP_PACKED_SIZE(length));
+        }
+        addPart(parts, &partCount, requests[i].packedText + OTP_PACKED_SIZE(offset), -1, 0, OTP_PACKED_SIZE(length));
+      } else {
+        if (!requests[i].padded){
+          addPart(parts, &partCount, requests[i].key + offset, requests[i].keyFD, offset, length);
+        }
+        addPart(parts, &partCount, requests[i].text + offset, requests[i].textFD, offset, length);
+      }
+      offset += length;
+    } while (offset < requests[i].length);
+  }
+
+  fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL) | O_NONBLOCK);
+  struct sendPart *unsent = parts;
+  struct frameReader reader;
+  memset(&reader, '\0', sizeof(reader));
+  while (1){
+    if (partCount > 0){
+      partCount = sendSome(socketFD, &unsent, partCount);
+      if (partCount < 0){
+        partCount = 0;
+      }
+    }
+    if (receiveSome(socketFD, &reader, requests, count, program, port) < 0){
+      break;
+    }
+    struct pollfd waitFor;
+    waitFor.fd = socketFD;
+    waitFor.events = POLLIN | (partCount > 0 ? POLLOUT : 0);
+    if (poll(&waitFor, 1, -1) < 0 && errno != EINTR){
+      error("CLIENT: ERROR waiting for the server");
+    }
+  }
+  free(headers);
+  free(parts);
+  int answered = 0;
+  for (int i = 0; i < count; i++){
+    answered += requests[i].done;
+  }
+  return answered - (count - pending);
+}
+
+int runClient(int argc, char *argv[], const struct otpClientProfile *profile){
+  struct sockaddr_in serverAddress;
+  // Check usage & args: <plaintext> <key> <port>, optionally followed by more <plaintext> <key> pairs
+  if (argc < 4 || (argc - 4) % 2 != 0) {
+    fprintf(stderr,"USAGE: %s <plaintext> <key> <port> [<plaintext> <key> ...]\n", argv[0]);
+    exit(0);
+  }
+  const char *port = argv[3];         //a port on localhost, or the path of a server's Unix socket
+  int resolved = 0;
+  const char *agentPath = getenv(OTP_AGENT_ENV);     //a local otp_agent keeping warm connections, if there is one
+
+  otpKernelInit();          // picks the validator for this CPU
+  signal(SIGPIPE, SIG_IGN);     // sendfile() has no MSG_NOSIGNAL, a server that hangs up is handled where the write fails
+
+  //every <plaintext> <key> pair is one request
+  int count = 1 + (argc - 4) / 2;
+  struct pipelinedRequest *requests = calloc(count, sizeof(struct pipelinedRequest));
+  if (requests == NULL){
+    error("CLIENT: ERROR allocating requests");
+  }
+  for (int pair = 0; pair < count; pair++){
+    const char *textPath = pair == 0 ? argv[1] : argv[4 + 2 * (pair - 1)];
+    const char *keyPath = pair == 0 ? argv[2] : argv[5 + 2 * (pair - 1)];
+    readRequestFiles(textPath, keyPath, &requests[pair], argv[0], profile);
+  }
+
+  //After we made sure that the data we are sending is read and is correct, attempt to connect to server.
+  //All requests are pipelined over one connection; if the server closes it early (e.g. its -r limit) the rest go over a new one.
+  //OTP_WIRE=packed sends them packed if the server can take that (it's not worth the copy on a local connection).
+  //OTP_WIRE=shared on a Unix socket shares a region with the server instead, every new connection shares it again.
+  const char *wire = getenv("OTP_WIRE");
+  int negotiate = wire != NULL && strcmp(wire, "packed") == 0;
+  int share = wire != NULL && strcmp(wire, "shared") == 0 && isLocalPath(port);
+  size_t regionSize = 0;
+  int regionFD = -1;
+  char *region = share ? createRegion(requests, count, &regionSize, &regionFD) : NULL;
+  share = region != NULL;
+  int answered = 0;
+  while (answered < count){
+    for (int i = 0; i < count; i++){        //a retry must not send half of a result as the text
+      if (!requests[i].done && requests[i].overwritten){
+        restoreText(&requests[i], region);
+      }
+    }
+    int socketFD = connectToServer(&serverAddress, &resolved, agentPath, argv[0], port);
+    int keepsOpen = 1;
+    if (negotiate){
+      if (probeServer(socketFD, OTP_FLAG_PACKED, -1, &keepsOpen, argv[0], port, profile) == OTP_STATUS_OK){
+        packRequests(requests, count);
+      }
+      negotiate = 0;
+    }
+    if (share && keepsOpen){
+      int accepted = probeServer(socketFD, OTP_FLAG_SHARED, regionFD, &keepsOpen, argv[0], port, profile) == OTP_STATUS_OK;
+      for (int i = 0; i < count; i++){        //an empty text would look like sharing the region again, it goes as it is
+        if (!requests[i].done){
+          requests[i].shared = accepted && keepsOpen && requests[i].length > 0;
+        }
+      }
+      share = accepted && keepsOpen;        //a server that can't share it, or has to close right after it: plain requests from now on
+    }
+    if (!keepsOpen){        //the probe used up what the server serves on one connection
+      close(socketFD);
+      continue;
+    }
+    int arrived = pipelineRequests(socketFD, requests, count, argv[0], port, profile);
+    close(socketFD);            // Close the socket
+    if (arrived == 0){          //the server hung up without answering anything
+      resultFailed();
+    }
+    answered += arrived;
+  }
+
+  for (int i = 0; i < count; i++){
+    if (requests[i].packed && requests[i].length > 0){      //back from symbols to characters, over the mapped text
+      otpUnpack(requests[i].packedText, requests[i].length);
+      otpSymbolsToText(requests[i].text, requests[i].packedText, requests[i].length);
+      free(requests[i].packedText);
+      free(requests[i].packedKey);
+    }
+    if (requests[i].padded){        //the segment is needed again for decryption
+      fprintf(stderr, "%s: key pad:%u@%llu\n", i == 0 ? argv[1] : argv[4 + 2 * (i - 1)],
+              requests[i].padId, (unsigned long long) requests[i].padOffset);
+    }
+    const char *result = requests[i].shared ? region + requests[i].sharedText : requests[i].text;
+    fwrite(result, 1, requests[i].length, stdout);      //send the result to stdout, add \n too
+    fputc('\n', stdout);
+    if (requests[i].textMapped > 0){
+      munmap(requests[i].text, requests[i].textMapped);
+    }
+    if (requests[i].keyMapped > 0){
+      munmap(requests[i].key, requests[i].keyMapped);
+    }
+    close(requests[i].textFD);
+    if (requests[i].keyFD >= 0){
+      close(requests[i].keyFD);
+    }
+  }
+  fflush(stdout);         //flush out the contents of an output stream
+  if (region != NULL){
+    munmap(region, regionSize);
+    close(regionFD);
+  }
+  free(requests);
+  return 0;
+}
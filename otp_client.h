@@ -0,0 +1,25 @@
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+#include <stdint.h>
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* Client code shared by enc_client and dec_client
+* 1. Map key + data files into memory and make sure they only use the allowed characters.
+* 2. Connect to the server and pipeline header + key + text of every request (otp_protocol.h).
+* 3. Print the results received back from the server in request order and exit the program.
+*/
+
+// what makes enc_client different from dec_client
+struct otpClientProfile {
+  uint32_t magic;                 // OTP_MAGIC_ENCRYPT or OTP_MAGIC_DECRYPT
+  const char *textDescription;    // how the text file is called in error messages
+};
+
+int runClient(int argc, char *argv[], const struct otpClientProfile *profile);
+
+#endif
@@ -0,0 +1,540 @@
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "otp_kernel.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+#define SYMBOLS 27
+
+static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+static unsigned char symbolOf[256];                   // character -> symbol
+static char encryptTable[SYMBOLS][SYMBOLS];           // [text symbol][key symbol] -> encrypted character
+static char decryptTable[SYMBOLS][SYMBOLS];           // [cipher symbol][key symbol] -> decrypted character
+static unsigned char isValid[256];                    // 1 for the characters of the alphabet
+
+/*---------------------------------------------------------------------------------------------------*/
+// scalar: two table lookups per character
+
+static void buildTables(void){
+  //c - 'A' as an unsigned byte is 0..25 for the letters and larger for everything else, which all becomes ' '.
+  //The vector kernels compute the symbols the same way (a saturating min), so every kernel agrees on bad input too.
+  for (int c = 0; c < 256; c++){
+    unsigned char symbol = (unsigned char) (c - 'A');
+    symbolOf[c] = symbol < SYMBOLS - 1 ? symbol : SYMBOLS - 1;
+    isValid[c] = symbol < SYMBOLS - 1 || c == ' ';
+  }
+  for (int text = 0; text < SYMBOLS; text++){
+    for (int key = 0; key < SYMBOLS; key++){
+      encryptTable[text][key] = alphabet[(text + key) % SYMBOLS];
+      decryptTable[text][key] = alphabet[(text - key + SYMBOLS) % SYMBOLS];
+    }
+  }
+}
+
+static void encryptScalar(char *text, const char *key, size_t length){
+  for (size_t i = 0; i < length; i++){
+    text[i] = encryptTable[symbolOf[(unsigned char) text[i]]][symbolOf[(unsigned char) key[i]]];
+  }
+}
+
+static void decryptScalar(char *text, const char *key, size_t length){
+  for (size_t i = 0; i < length; i++){
+    text[i] = decryptTable[symbolOf[(unsigned char) text[i]]][symbolOf[(unsigned char) key[i]]];
+  }
+}
+
+static size_t findInvalidScalar(const char *text, size_t length){
+  size_t i = 0;
+  while (i < length && isValid[(unsigned char) text[i]]){
+    i++;
+  }
+  return i;
+}
+
+// the same on symbols 0..26 (packed requests, see otpPack)
+static void encryptSymbolsScalar(char *text, const char *key, size_t length){
+  for (size_t i = 0; i < length; i++){
+    unsigned sum = (unsigned char) text[i] + (unsigned char) key[i];
+    text[i] = sum >= SYMBOLS ? sum - SYMBOLS : sum;
+  }
+}
+
+static void decryptSymbolsScalar(char *text, const char *key, size_t length){
+  for (size_t i = 0; i < length; i++){
+    int diff = (unsigned char) text[i] - (unsigned char) key[i];
+    text[i] = diff < 0 ? diff + SYMBOLS : diff;
+  }
+}
+
+static void toSymbolsScalar(char *symbols, const char *text, size_t length){
+  for (size_t i = 0; i < length; i++){
+    symbols[i] = symbolOf[(unsigned char) text[i]];
+  }
+}
+
+static void toTextScalar(char *text, const char *symbols, size_t length){
+  for (size_t i = 0; i < length; i++){
+    text[i] = alphabet[(unsigned char) symbols[i]];
+  }
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// Vector kernels, all the same steps on 16/32/64 characters at a time:
+//   symbol = min(c - 'A', 26)                  (unsigned, ' ' and bad characters wrap around and become 26)
+//   sum    = min(t + k, t + k - 27)            (unsigned, whichever didn't wrap around is the value mod 27)
+//   diff   = min(t - k, t - k + 27)
+//   c      = symbol == 26 ? ' ' : symbol + 'A'
+// and to validate: c - 'A' < 26 (unsigned) or c == ' ', the first lane where neither holds is the bad byte
+
+__attribute__((target("sse4.1")))
+static inline __m128i symbolsSSE(__m128i characters){
+  return _mm_min_epu8(_mm_sub_epi8(characters, _mm_set1_epi8('A')), _mm_set1_epi8(SYMBOLS - 1));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i charactersSSE(__m128i symbols){
+  __m128i space = _mm_cmpeq_epi8(symbols, _mm_set1_epi8(SYMBOLS - 1));
+  return _mm_blendv_epi8(_mm_add_epi8(symbols, _mm_set1_epi8('A')), _mm_set1_epi8(' '), space);
+}
+
+__attribute__((target("sse4.1")))
+static void encryptSSE(char *text, const char *key, size_t length){
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16){
+    __m128i sum = _mm_add_epi8(symbolsSSE(_mm_loadu_si128((const __m128i*) (text + i))),
+                               symbolsSSE(_mm_loadu_si128((const __m128i*) (key + i))));
+    sum = _mm_min_epu8(sum, _mm_sub_epi8(sum, _mm_set1_epi8(SYMBOLS)));
+    _mm_storeu_si128((__m128i*) (text + i), charactersSSE(sum));
+  }
+  encryptScalar(text + i, key + i, length - i);
+}
+
+__attribute__((target("sse4.1")))
+static void decryptSSE(char *text, const char *key, size_t length){
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16){
+    __m128i diff = _mm_sub_epi8(symbolsSSE(_mm_loadu_si128((const __m128i*) (text + i))),
+                                symbolsSSE(_mm_loadu_si128((const __m128i*) (key + i))));
+    diff = _mm_min_epu8(diff, _mm_add_epi8(diff, _mm_set1_epi8(SYMBOLS)));
+    _mm_storeu_si128((__m128i*) (text + i), charactersSSE(diff));
+  }
+  decryptScalar(text + i, key + i, length - i);
+}
+
+__attribute__((target("sse4.1")))
+static size_t findInvalidSSE(const char *text, size_t length){
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16){
+    __m128i characters = _mm_loadu_si128((const __m128i*) (text + i));
+    __m128i letters = _mm_sub_epi8(characters, _mm_set1_epi8('A'));
+    __m128i valid = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(letters, _mm_set1_epi8(SYMBOLS - 2)), letters),
+                                 _mm_cmpeq_epi8(characters, _mm_set1_epi8(' ')));
+    unsigned invalid = ~_mm_movemask_epi8(valid) & 0xffff;
+    if (invalid != 0){
+      return i + __builtin_ctz(invalid);
+    }
+  }
+  return i + findInvalidScalar(text + i, length - i);
+}
+
+__attribute__((target("sse4.1")))
+static void encryptSymbolsSSE(char *text, const char *key, size_t length){
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16){
+    __m128i sum = _mm_add_epi8(_mm_loadu_si128((const __m128i*) (text + i)), _mm_loadu_si128((const __m128i*) (key + i)));
+    _mm_storeu_si128((__m128i*) (text + i), _mm_min_epu8(sum, _mm_sub_epi8(sum, _mm_set1_epi8(SYMBOLS))));
+  }
+  encryptSymbolsScalar(text + i, key + i, length - i);
+}
+
+__attribute__((target("sse4.1")))
+static void decryptSymbolsSSE(char *text, const char *key, size_t length){
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16){
+    __m128i diff = _mm_sub_epi8(_mm_loadu_si128((const __m128i*) (text + i)), _mm_loadu_si128((const __m128i*) (key + i)));
+    _mm_storeu_si128((__m128i*) (text + i), _mm_min_epu8(diff, _mm_add_epi8(diff, _mm_set1_epi8(SYMBOLS))));
+  }
+  decryptSymbolsScalar(text + i, key + i, length - i);
+}
+
+__attribute__((target("sse4.1")))
+static void toSymbolsSSE(char *symbols, const char *text, size_t length){
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16){
+    _mm_storeu_si128((__m128i*) (symbols + i), symbolsSSE(_mm_loadu_si128((const __m128i*) (text + i))));
+  }
+  toSymbolsScalar(symbols + i, text + i, length - i);
+}
+
+__attribute__((target("sse4.1")))
+static void toTextSSE(char *text, const char *symbols, size_t length){
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16){
+    _mm_storeu_si128((__m128i*) (text + i), charactersSSE(_mm_loadu_si128((const __m128i*) (symbols + i))));
+  }
+  toTextScalar(text + i, symbols + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i symbolsAVX2(__m256i characters){
+  return _mm256_min_epu8(_mm256_sub_epi8(characters, _mm256_set1_epi8('A')), _mm256_set1_epi8(SYMBOLS - 1));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i charactersAVX2(__m256i symbols){
+  __m256i space = _mm256_cmpeq_epi8(symbols, _mm256_set1_epi8(SYMBOLS - 1));
+  return _mm256_blendv_epi8(_mm256_add_epi8(symbols, _mm256_set1_epi8('A')), _mm256_set1_epi8(' '), space);
+}
+
+__attribute__((target("avx2")))
+static void encryptAVX2(char *text, const char *key, size_t length){
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32){
+    __m256i sum = _mm256_add_epi8(symbolsAVX2(_mm256_loadu_si256((const __m256i*) (text + i))),
+                                  symbolsAVX2(_mm256_loadu_si256((const __m256i*) (key + i))));
+    sum = _mm256_min_epu8(sum, _mm256_sub_epi8(sum, _mm256_set1_epi8(SYMBOLS)));
+    _mm256_storeu_si256((__m256i*) (text + i), charactersAVX2(sum));
+  }
+  encryptSSE(text + i, key + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static void decryptAVX2(char *text, const char *key, size_t length){
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32){
+    __m256i diff = _mm256_sub_epi8(symbolsAVX2(_mm256_loadu_si256((const __m256i*) (text + i))),
+                                   symbolsAVX2(_mm256_loadu_si256((const __m256i*) (key + i))));
+    diff = _mm256_min_epu8(diff, _mm256_add_epi8(diff, _mm256_set1_epi8(SYMBOLS)));
+    _mm256_storeu_si256((__m256i*) (text + i), charactersAVX2(diff));
+  }
+  decryptSSE(text + i, key + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static size_t findInvalidAVX2(const char *text, size_t length){
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32){
+    __m256i characters = _mm256_loadu_si256((const __m256i*) (text + i));
+    __m256i letters = _mm256_sub_epi8(characters, _mm256_set1_epi8('A'));
+    __m256i valid = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(letters, _mm256_set1_epi8(SYMBOLS - 2)), letters),
+                                    _mm256_cmpeq_epi8(characters, _mm256_set1_epi8(' ')));
+    unsigned invalid = ~(unsigned) _mm256_movemask_epi8(valid);
+    if (invalid != 0){
+      return i + __builtin_ctz(invalid);
+    }
+  }
+  return i + findInvalidSSE(text + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static void encryptSymbolsAVX2(char *text, const char *key, size_t length){
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32){
+    __m256i sum = _mm256_add_epi8(_mm256_loadu_si256((const __m256i*) (text + i)), _mm256_loadu_si256((const __m256i*) (key + i)));
+    _mm256_storeu_si256((__m256i*) (text + i), _mm256_min_epu8(sum, _mm256_sub_epi8(sum, _mm256_set1_epi8(SYMBOLS))));
+  }
+  encryptSymbolsSSE(text + i, key + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static void decryptSymbolsAVX2(char *text, const char *key, size_t length){
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32){
+    __m256i diff = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*) (text + i)), _mm256_loadu_si256((const __m256i*) (key + i)));
+    _mm256_storeu_si256((__m256i*) (text + i), _mm256_min_epu8(diff, _mm256_add_epi8(diff, _mm256_set1_epi8(SYMBOLS))));
+  }
+  decryptSymbolsSSE(text + i, key + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static void toSymbolsAVX2(char *symbols, const char *text, size_t length){
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32){
+    _mm256_storeu_si256((__m256i*) (symbols + i), symbolsAVX2(_mm256_loadu_si256((const __m256i*) (text + i))));
+  }
+  toSymbolsSSE(symbols + i, text + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static void toTextAVX2(char *text, const char *symbols, size_t length){
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32){
+    _mm256_storeu_si256((__m256i*) (text + i), charactersAVX2(_mm256_loadu_si256((const __m256i*) (symbols + i))));
+  }
+  toTextSSE(text + i, symbols + i, length - i);
+}
+
+__attribute__((target("avx512bw")))
+static inline __m512i symbolsAVX512(__m512i characters){
+  return _mm512_min_epu8(_mm512_sub_epi8(characters, _mm512_set1_epi8('A')), _mm512_set1_epi8(SYMBOLS - 1));
+}
+
+__attribute__((target("avx512bw")))
+static inline __m512i charactersAVX512(__m512i symbols){
+  __mmask64 space = _mm512_cmpeq_epi8_mask(symbols, _mm512_set1_epi8(SYMBOLS - 1));
+  return _mm512_mask_blend_epi8(space, _mm512_add_epi8(symbols, _mm512_set1_epi8('A')), _mm512_set1_epi8(' '));
+}
+
+// the tail is handled with masked loads/stores instead of a scalar loop
+__attribute__((target("avx512bw")))
+static void encryptAVX512(char *text, const char *key, size_t length){
+  for (size_t i = 0; i < length; i += 64){
+    __mmask64 lanes = length - i >= 64 ? ~(__mmask64) 0 : ((__mmask64) 1 << (length - i)) - 1;
+    __m512i sum = _mm512_add_epi8(symbolsAVX512(_mm512_maskz_loadu_epi8(lanes, text + i)),
+                                  symbolsAVX512(_mm512_maskz_loadu_epi8(lanes, key + i)));
+    sum = _mm512_min_epu8(sum, _mm512_sub_epi8(sum, _mm512_set1_epi8(SYMBOLS)));
+    _mm512_mask_storeu_epi8(text + i, lanes, charactersAVX512(sum));
+  }
+}
+
+__attribute__((target("avx512bw")))
+static void decryptAVX512(char *text, const char *key, size_t length){
+  for (size_t i = 0; i < length; i += 64){
+    __mmask64 lanes = length - i >= 64 ? ~(__mmask64) 0 : ((__mmask64) 1 << (length - i)) - 1;
+    __m512i diff = _mm512_sub_epi8(symbolsAVX512(_mm512_maskz_loadu_epi8(lanes, text + i)),
+                                   symbolsAVX512(_mm512_maskz_loadu_epi8(lanes, key + i)));
+    diff = _mm512_min_epu8(diff, _mm512_add_epi8(diff, _mm512_set1_epi8(SYMBOLS)));
+    _mm512_mask_storeu_epi8(text + i, lanes, charactersAVX512(diff));
+  }
+}
+
+__attribute__((target("avx512bw")))
+static size_t findInvalidAVX512(const char *text, size_t length){
+  for (size_t i = 0; i < length; i += 64){
+    __mmask64 lanes = length - i >= 64 ? ~(__mmask64) 0 : ((__mmask64) 1 << (length - i)) - 1;
+    __m512i characters = _mm512_maskz_loadu_epi8(lanes, text + i);
+    __mmask64 valid = _mm512_cmplt_epu8_mask(_mm512_sub_epi8(characters, _mm512_set1_epi8('A')), _mm512_set1_epi8(SYMBOLS - 1))
+                      | _mm512_cmpeq_epi8_mask(characters, _mm512_set1_epi8(' '));
+    __mmask64 invalid = ~valid & lanes;
+    if (invalid != 0){
+      return i + __builtin_ctzll(invalid);
+    }
+  }
+  return length;
+}
+
+__attribute__((target("avx512bw")))
+static void encryptSymbolsAVX512(char *text, const char *key, size_t length){
+  for (size_t i = 0; i < length; i += 64){
+    __mmask64 lanes = length - i >= 64 ? ~(__mmask64) 0 : ((__mmask64) 1 << (length - i)) - 1;
+    __m512i sum = _mm512_add_epi8(_mm512_maskz_loadu_epi8(lanes, text + i), _mm512_maskz_loadu_epi8(lanes, key + i));
+    _mm512_mask_storeu_epi8(text + i, lanes, _mm512_min_epu8(sum, _mm512_sub_epi8(sum, _mm512_set1_epi8(SYMBOLS))));
+  }
+}
+
+__attribute__((target("avx512bw")))
+static void decryptSymbolsAVX512(char *text, const char *key, size_t length){
+  for (size_t i = 0; i < length; i += 64){
+    __mmask64 lanes = length - i >= 64 ? ~(__mmask64) 0 : ((__mmask64) 1 << (length - i)) - 1;
+    __m512i diff = _mm512_sub_epi8(_mm512_maskz_loadu_epi8(lanes, text + i), _mm512_maskz_loadu_epi8(lanes, key + i));
+    _mm512_mask_storeu_epi8(text + i, lanes, _mm512_min_epu8(diff, _mm512_add_epi8(diff, _mm512_set1_epi8(SYMBOLS))));
+  }
+}
+
+__attribute__((target("avx512bw")))
+static void toSymbolsAVX512(char *symbols, const char *text, size_t length){
+  for (size_t i = 0; i < length; i += 64){
+    __mmask64 lanes = length - i >= 64 ? ~(__mmask64) 0 : ((__mmask64) 1 << (length - i)) - 1;
+    _mm512_mask_storeu_epi8(symbols + i, lanes, symbolsAVX512(_mm512_maskz_loadu_epi8(lanes, text + i)));
+  }
+}
+
+__attribute__((target("avx512bw")))
+static void toTextAVX512(char *text, const char *symbols, size_t length){
+  for (size_t i = 0; i < length; i += 64){
+    __mmask64 lanes = length - i >= 64 ? ~(__mmask64) 0 : ((__mmask64) 1 << (length - i)) - 1;
+    _mm512_mask_storeu_epi8(text + i, lanes, charactersAVX512(_mm512_maskz_loadu_epi8(lanes, symbols + i)));
+  }
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// Packing: every 3 symbols become one big endian 16 bit value s0 * 729 + s1 * 27 + s2, a missing
+// symbol of the last group counts as 0. Values above 26 * 729 + 26 * 27 + 26 can only come from a
+// broken client, they unpack as three spaces. Both work in place: packing goes front to back (a
+// group is never written past where it was read), unpacking back to front.
+
+#define PACKED_MAX (SYMBOLS * SYMBOLS * SYMBOLS - 1)
+
+static void packScalar(char *buffer, size_t length){
+  const unsigned char *symbols = (const unsigned char*) buffer;
+  unsigned char *packed = (unsigned char*) buffer;
+  for (size_t group = 0; group * 3 < length; group++){
+    size_t i = group * 3;
+    unsigned value = symbols[i] * SYMBOLS * SYMBOLS;
+    value += i + 1 < length ? symbols[i + 1] * SYMBOLS : 0;
+    value += i + 2 < length ? symbols[i + 2] : 0;
+    packed[2 * group] = value >> 8;
+    packed[2 * group + 1] = value & 0xff;
+  }
+}
+
+// the groups from `group` on, back to front
+static void unpackGroupsScalar(char *buffer, size_t length, size_t group){
+  const unsigned char *packed = (const unsigned char*) buffer;
+  unsigned char *symbols = (unsigned char*) buffer;
+  for (size_t g = (length + 2) / 3; g-- > group; ){
+    unsigned value = (packed[2 * g] << 8) | packed[2 * g + 1];
+    value = value > PACKED_MAX ? PACKED_MAX : value;
+    size_t i = g * 3;
+    unsigned char first = value / (SYMBOLS * SYMBOLS), second = value / SYMBOLS % SYMBOLS, third = value % SYMBOLS;
+    symbols[i] = first;       //read both bytes before writing, the first group overlaps itself
+    if (i + 1 < length){
+      symbols[i + 1] = second;
+    }
+    if (i + 2 < length){
+      symbols[i + 2] = third;
+    }
+  }
+}
+
+static void unpackScalar(char *buffer, size_t length){
+  unpackGroupsScalar(buffer, length, 0);
+}
+
+// 24 symbols (8 groups) -> 16 bytes: shuffle every third symbol into 16 bit lanes, multiply-add, swap to big endian
+__attribute__((target("sse4.1")))
+static void packSSE(char *buffer, size_t length){
+  size_t i = 0, out = 0;
+  for (; i + 24 <= length; i += 24, out += 16){
+    __m128i low = _mm_loadu_si128((const __m128i*) (buffer + i));
+    __m128i high = _mm_loadl_epi64((const __m128i*) (buffer + i + 16));
+    __m128i first = _mm_or_si128(_mm_shuffle_epi8(low, _mm_setr_epi8(0, -1, 3, -1, 6, -1, 9, -1, 12, -1, 15, -1, -1, -1, -1, -1)),
+                                 _mm_shuffle_epi8(high, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, -1, 5, -1)));
+    __m128i second = _mm_or_si128(_mm_shuffle_epi8(low, _mm_setr_epi8(1, -1, 4, -1, 7, -1, 10, -1, 13, -1, -1, -1, -1, -1, -1, -1)),
+                                  _mm_shuffle_epi8(high, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, -1, 3, -1, 6, -1)));
+    __m128i third = _mm_or_si128(_mm_shuffle_epi8(low, _mm_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, 14, -1, -1, -1, -1, -1, -1, -1)),
+                                 _mm_shuffle_epi8(high, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, -1, 4, -1, 7, -1)));
+    __m128i value = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(first, _mm_set1_epi16(SYMBOLS * SYMBOLS)),
+                                                _mm_mullo_epi16(second, _mm_set1_epi16(SYMBOLS))), third);
+    value = _mm_shuffle_epi8(value, _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+    _mm_storeu_si128((__m128i*) (buffer + out), value);
+  }
+  memmove(buffer + out, buffer + i, length - i);       //the tail is less than 8 groups, pack it where it belongs
+  packScalar(buffer + out, length - i);
+}
+
+// 16 bytes -> 24 symbols: divide by 729 and 27 with multiply-high (exact for every value up to PACKED_MAX), then interleave
+__attribute__((target("sse4.1")))
+static void unpackSSE(char *buffer, size_t length){
+  size_t blocks = length / 24;
+  unpackGroupsScalar(buffer, length, blocks * 8);      //the tail first, it lies behind the blocks
+  for (size_t block = blocks; block-- > 0; ){
+    __m128i value = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (buffer + block * 16)),
+                                     _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+    value = _mm_min_epu16(value, _mm_set1_epi16(PACKED_MAX));
+    __m128i first = _mm_srli_epi16(_mm_mulhi_epu16(value, _mm_set1_epi16(23015)), 8);          // value / 729
+    __m128i rest = _mm_sub_epi16(value, _mm_mullo_epi16(first, _mm_set1_epi16(SYMBOLS * SYMBOLS)));
+    __m128i second = _mm_mulhi_epu16(rest, _mm_set1_epi16(2428));                             // rest / 27
+    __m128i third = _mm_sub_epi16(rest, _mm_mullo_epi16(second, _mm_set1_epi16(SYMBOLS)));
+    __m128i firstSecond = _mm_packus_epi16(first, second);      //bytes 0..7 first, 8..15 second
+    __m128i thirds = _mm_packus_epi16(third, third);
+    __m128i low = _mm_or_si128(_mm_shuffle_epi8(firstSecond, _mm_setr_epi8(0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5)),
+                               _mm_shuffle_epi8(thirds, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)));
+    __m128i high = _mm_or_si128(_mm_shuffle_epi8(firstSecond, _mm_setr_epi8(13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                                _mm_shuffle_epi8(thirds, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1)));
+    _mm_storeu_si128((__m128i*) (buffer + block * 24), low);
+    _mm_storel_epi64((__m128i*) (buffer + block * 24 + 16), high);
+  }
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// dispatch
+
+// narrowest first, otpKernelInit() takes the last one the CPU supports
+// (the wider kernels pack with the SSE code, a group of 3 doesn't spread well over more lanes)
+static const struct otpKernel kernels[] = {
+  { "scalar",   encryptScalar, decryptScalar, findInvalidScalar,
+                encryptSymbolsScalar, decryptSymbolsScalar, toSymbolsScalar, toTextScalar, packScalar, unpackScalar },
+  { "sse4.1",   encryptSSE,    decryptSSE,    findInvalidSSE,
+                encryptSymbolsSSE,    decryptSymbolsSSE,    toSymbolsSSE,    toTextSSE,    packSSE,    unpackSSE },
+  { "avx2",     encryptAVX2,   decryptAVX2,   findInvalidAVX2,
+                encryptSymbolsAVX2,   decryptSymbolsAVX2,   toSymbolsAVX2,   toTextAVX2,   packSSE,    unpackSSE },
+  { "avx512bw", encryptAVX512, decryptAVX512, findInvalidAVX512,
+                encryptSymbolsAVX512, decryptSymbolsAVX512, toSymbolsAVX512, toTextAVX512, packSSE,    unpackSSE },
+};
+#define KERNEL_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+static const struct otpKernel *active = &kernels[0];
+
+// cpuid tells whether the CPU (and the OS, for the wider registers) supports a kernel
+static int kernelSupported(const struct otpKernel *kernel){
+  __builtin_cpu_init();
+  if (strcmp(kernel->name, "sse4.1") == 0){
+    return __builtin_cpu_supports("sse4.1");
+  }
+  if (strcmp(kernel->name, "avx2") == 0){
+    return __builtin_cpu_supports("avx2");
+  }
+  if (strcmp(kernel->name, "avx512bw") == 0){
+    return __builtin_cpu_supports("avx512bw");
+  }
+  return 1;
+}
+
+const struct otpKernel *otpKernelFind(const char *name){
+  for (size_t i = 0; i < KERNEL_COUNT; i++){
+    if (strcmp(kernels[i].name, name) == 0){
+      return kernelSupported(&kernels[i]) ? &kernels[i] : NULL;
+    }
+  }
+  return NULL;
+}
+
+void otpKernelInit(void){
+  buildTables();
+  const char *forced = getenv("OTP_KERNEL");
+  if (forced != NULL && otpKernelFind(forced) != NULL){
+    active = otpKernelFind(forced);
+    return;
+  }
+  for (size_t i = 0; i < KERNEL_COUNT; i++){
+    if (kernelSupported(&kernels[i])){
+      active = &kernels[i];
+    }
+  }
+}
+
+const struct otpKernel *otpKernelActive(void){
+  return active;
+}
+
+void otpEncrypt(char *text, const char *key, size_t length){
+  active->encrypt(text, key, length);
+}
+
+void otpDecrypt(char *text, const char *key, size_t length){
+  active->decrypt(text, key, length);
+}
+
+size_t otpFindInvalid(const char *text, size_t length){
+  return active->findInvalid(text, length);
+}
+
+void otpEncryptSymbols(char *symbols, const char *key, size_t length){
+  active->encryptSymbols(symbols, key, length);
+}
+
+void otpDecryptSymbols(char *symbols, const char *key, size_t length){
+  active->decryptSymbols(symbols, key, length);
+}
+
+void otpTextToSymbols(char *symbols, const char *text, size_t length){
+  active->toSymbols(symbols, text, length);
+}
+
+void otpSymbolsToText(char *text, const char *symbols, size_t length){
+  active->toText(text, symbols, length);
+}
+
+void otpPack(char *buffer, size_t length){
+  active->pack(buffer, length);
+}
+
+void otpUnpack(char *buffer, size_t length){
+  active->unpack(buffer, length);
+}
@@ -0,0 +1,78 @@
+#ifndef OTP_KERNEL_H
+#define OTP_KERNEL_H
+
+#include <stddef.h>
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* The one-time pad itself, shared by enc_server and dec_server.
+* Every character of the alphabet "ABCDEFGHIJKLMNOPQRSTUVWXYZ " is a symbol 0..26 ('A' = 0, ' ' = 26),
+* encryption adds the key symbol to the text symbol mod 27, decryption subtracts it.
+*
+* There is a table-driven scalar kernel and SSE4.1, AVX2 and AVX-512BW kernels that handle
+* 16/32/64 characters at a time. otpKernelInit() picks the widest one the CPU supports
+* (the OTP_KERNEL environment variable can force one by name). All of them give the same
+* result byte for byte, characters outside the alphabet are treated as ' '.
+* The clients use the same kernels to check their input before sending it.
+*
+* Packed requests (OTP_FLAG_PACKED) carry symbols instead of characters, 3 of them in 2 bytes.
+* The servers unpack them into symbol indices, add/subtract those directly and pack the result,
+* the clients convert between characters and symbols around the packing.
+*/
+
+// transforms length chars of text in place using the key
+typedef void (*otpKernelFunction)(char *text, const char *key, size_t length);
+
+struct otpKernel {
+  const char *name;               // "scalar", "sse4.1", "avx2", "avx512bw"
+  otpKernelFunction encrypt;
+  otpKernelFunction decrypt;
+  size_t (*findInvalid)(const char *text, size_t length);
+  otpKernelFunction encryptSymbols;       // encrypt/decrypt on symbols 0..26 instead of characters
+  otpKernelFunction decryptSymbols;
+  void (*toSymbols)(char *symbols, const char *text, size_t length);
+  void (*toText)(char *text, const char *symbols, size_t length);
+  void (*pack)(char *buffer, size_t length);
+  void (*unpack)(char *buffer, size_t length);
+};
+
+// pick the kernel used by otpEncrypt/otpDecrypt, call once before the first of them
+void otpKernelInit(void);
+
+// the kernel otpKernelInit() picked
+const struct otpKernel *otpKernelActive(void);
+
+// the kernel with that name if this CPU can run it, NULL otherwise
+const struct otpKernel *otpKernelFind(const char *name);
+
+// text[i] = text[i] + key[i] mod 27, in place
+void otpEncrypt(char *text, const char *key, size_t length);
+
+// text[i] = text[i] - key[i] mod 27, in place
+void otpDecrypt(char *text, const char *key, size_t length);
+
+// offset of the first character outside the alphabet, length if there is none
+size_t otpFindInvalid(const char *text, size_t length);
+
+// symbols[i] = symbols[i] + key[i] mod 27, on symbols 0..26
+void otpEncryptSymbols(char *symbols, const char *key, size_t length);
+
+// symbols[i] = symbols[i] - key[i] mod 27, on symbols 0..26
+void otpDecryptSymbols(char *symbols, const char *key, size_t length);
+
+// characters -> symbols 0..26 (anything outside the alphabet becomes 26), may be done in place
+void otpTextToSymbols(char *symbols, const char *text, size_t length);
+
+// symbols 0..26 -> characters, may be done in place
+void otpSymbolsToText(char *text, const char *symbols, size_t length);
+
+// pack length symbols in place into OTP_PACKED_SIZE(length) bytes
+void otpPack(char *buffer, size_t length);
+
+// unpack OTP_PACKED_SIZE(length) bytes in place into length symbols (the buffer needs length + 1 bytes)
+void otpUnpack(char *buffer, size_t length);
+
+#endif
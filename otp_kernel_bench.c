@@ -0,0 +1,575 @@
+#define _GNU_SOURCE             // sched_setaffinity(), sched_getcpu()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <x86intrin.h>  // __rdtsc()
+
+#include <stdint.h>
+#include <err.h>
+
+#include "otp_kernel.h"
+#include "otp_protocol.h"   // OTP_PACKED_SIZE
+#include "otp_random.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* Kernel bench code
+* 1. Pin to one core and see how fast the time stamp counter ticks.
+* 2. For every buffer size, fill key and text with random characters and run every variant on them:
+*    the loops the servers and the client started with (reference), the table-driven scalar kernel and the vector kernels.
+*    Packed requests add the same on symbols, the conversions between characters and symbols, packing and unpacking,
+*    their reference is a plain loop over the definition in otp_protocol.h.
+* 3. Check every variant against the reference byte for byte (and the validation offsets on texts with a bad character).
+* 4. Warm up, then time repeated passes over the buffer and print the median in chars per counter tick and GB/s.
+*/
+
+#define DEFAULT_SIZES "4k,32k,256k,4M,64M"        // L1, L1/L2, L2, L3, DRAM on most machines
+#define DEFAULT_REPEATS 5
+#define MIN_MEASURE_NS 50000000LL       // every repetition runs at least that long
+#define WARMUP_NS 100000000LL
+#define MAX_SIZES 16
+#define MAX_REPEATS 101
+
+static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+static const char *kernelNames[] = { "scalar", "sse4.1", "avx2", "avx512bw" };
+#define KERNEL_NAMES (sizeof(kernelNames) / sizeof(kernelNames[0]))
+
+// what is being measured: the reference loops or one of the kernels of otp_kernel.c
+struct variant {
+  const char *name;
+  void (*encrypt)(char *text, const char *key, size_t length);
+  void (*decrypt)(char *text, const char *key, size_t length);
+  size_t (*findInvalid)(const char *text, size_t length);
+  void (*encryptSymbols)(char *text, const char *key, size_t length);
+  void (*decryptSymbols)(char *text, const char *key, size_t length);
+  void (*toSymbols)(char *symbols, const char *text, size_t length);
+  void (*toText)(char *text, const char *symbols, size_t length);
+  void (*pack)(char *buffer, size_t length);
+  void (*unpack)(char *buffer, size_t length);
+};
+
+enum operation { OPERATION_ENCRYPT, OPERATION_DECRYPT, OPERATION_VALIDATE, OPERATION_ENCRYPT_SYMBOLS, OPERATION_DECRYPT_SYMBOLS,
+                 OPERATION_TO_SYMBOLS, OPERATION_TO_TEXT, OPERATION_PACK, OPERATION_UNPACK };
+static const char *operationNames[] = { "encrypt", "decrypt", "validate", "sym-enc", "sym-dec", "to-sym", "to-text", "pack", "unpack" };
+
+// the random input, as characters and as symbols
+struct benchData {
+  char *text, *key;
+  char *textSymbols, *keySymbols;
+};
+
+static volatile size_t sink;    // keeps the validation results alive
+
+static void usage(const char *program){
+  fprintf(stderr, "USAGE: %s [-s sizes] [-k kernels] [-c cpu] [-r repeats]\n", program);
+  fprintf(stderr, "  sizes: comma separated, k/M/G suffixes (default %s), kernels: comma separated names (default: all this CPU runs)\n", DEFAULT_SIZES);
+  exit(1);
+}
+
+static long long nowNs(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// reference: the per-character loops enc_server, dec_server and enc_client were written with
+// (without the strlen() in the loop condition, which made them quadratic)
+
+__attribute__((noinline))
+static void encryptReference(char *text, const char *key, size_t length){
+  for (size_t i = 0; i < length; i++){
+    if (text[i] == ' ' && key[i] == ' '){
+      text[i] = (26 + 26) % 27;
+    } else if (text[i] == ' ' && key[i] != ' '){
+      text[i] = (26 + (key[i] - 65)) % 27;
+    } else if (text[i] != ' ' && key[i] == ' '){
+      text[i] = ((text[i] - 65) + 26) % 27;
+    } else {
+      text[i] = ((text[i] - 65) + (key[i] - 65)) % 27;
+    }
+    text[i] = text[i] == 26 ? ' ' : text[i] + 65;
+  }
+}
+
+__attribute__((noinline))
+static void decryptReference(char *text, const char *key, size_t length){
+  for (size_t i = 0; i < length; i++){
+    if (text[i] == ' ' && key[i] == ' '){
+      text[i] = (26 - 26) % 27;
+    } else if (text[i] == ' ' && key[i] != ' '){
+      text[i] = (26 - (key[i] - 65)) % 27;
+    } else if (text[i] != ' ' && key[i] == ' '){
+      text[i] = ((text[i] - 65) - 26) % 27;
+    } else {
+      text[i] = ((text[i] - 65) - (key[i] - 65)) % 27;
+    }
+    if (text[i] < 0){
+      text[i] = text[i] + 27;
+    }
+    text[i] = text[i] == 26 ? ' ' : text[i] + 65;
+  }
+}
+
+// every character looked up in the alphabet
+__attribute__((noinline))
+static size_t findInvalidReference(const char *text, size_t length){
+  for (size_t i = 0; i < length; i++){
+    int occur = 0;
+    for (int j = 0; j < 27; j++){
+      if (text[i] == alphabet[j]){
+        occur = 1;
+        break;
+      }
+    }
+    if (!occur){
+      return i;
+    }
+  }
+  return length;
+}
+
+// packed requests: symbols 0..26 ('A' = 0, ' ' = 26), anything outside the alphabet is a ' '
+__attribute__((noinline))
+static void encryptSymbolsReference(char *text, const char *key, size_t length){
+  for (size_t i = 0; i < length; i++){
+    text[i] = (text[i] + key[i]) % 27;
+  }
+}
+
+__attribute__((noinline))
+static void decryptSymbolsReference(char *text, const char *key, size_t length){
+  for (size_t i = 0; i < length; i++){
+    text[i] = (text[i] - key[i] + 27) % 27;
+  }
+}
+
+__attribute__((noinline))
+static void toSymbolsReference(char *symbols, const char *text, size_t length){
+  for (size_t i = 0; i < length; i++){
+    const char *found = text[i] != '\0' ? strchr(alphabet, text[i]) : NULL;
+    symbols[i] = found != NULL ? found - alphabet : 26;
+  }
+}
+
+__attribute__((noinline))
+static void toTextReference(char *text, const char *symbols, size_t length){
+  for (size_t i = 0; i < length; i++){
+    text[i] = alphabet[(int) symbols[i]];
+  }
+}
+
+// every 3 symbols one big endian s0 * 729 + s1 * 27 + s2, a missing symbol of the last group is 0
+__attribute__((noinline))
+static void packReference(char *buffer, size_t length){
+  unsigned char *bytes = (unsigned char*) buffer;
+  size_t out = 0;
+  for (size_t i = 0; i < length; i += 3){
+    int s0 = bytes[i], s1 = i + 1 < length ? bytes[i + 1] : 0, s2 = i + 2 < length ? bytes[i + 2] : 0;
+    int value = s0 * 729 + s1 * 27 + s2;
+    bytes[out++] = value / 256;
+    bytes[out++] = value % 256;
+  }
+}
+
+// back to front, so the symbols never overwrite a group still to be read; values past 26 26 26 are three spaces
+__attribute__((noinline))
+static void unpackReference(char *buffer, size_t length){
+  unsigned char *bytes = (unsigned char*) buffer;
+  for (size_t group = (length + 2) / 3; group-- > 0; ){
+    int value = bytes[2 * group] * 256 + bytes[2 * group + 1];
+    if (value > 26 * 729 + 26 * 27 + 26){
+      value = 26 * 729 + 26 * 27 + 26;
+    }
+    int s0 = value / 729, s1 = value / 27 % 27, s2 = value % 27;
+    bytes[3 * group] = s0;
+    if (3 * group + 1 < length){
+      bytes[3 * group + 1] = s1;
+    }
+    if (3 * group + 2 < length){
+      bytes[3 * group + 2] = s2;
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+
+// a length with an optional k/M/G suffix, returns the character after it (NULL if there is no number)
+static const char *parseSize(const char *text, size_t *size){
+  char *end;
+  if (*text < '0' || *text > '9'){
+    return NULL;
+  }
+  *size = strtoull(text, &end, 10);
+  switch (*end){
+    case 'k': case 'K': *size <<= 10; end++; break;
+    case 'M': *size <<= 20; end++; break;
+    case 'G': *size <<= 30; end++; break;
+  }
+  return end;
+}
+
+static int parseSizes(const char *spec, size_t *sizes){
+  int count = 0;
+  while (count < MAX_SIZES){
+    if ((spec = parseSize(spec, &sizes[count])) == NULL || sizes[count] == 0){
+      return -1;
+    }
+    count++;
+    if (*spec == '\0'){
+      return count;
+    }
+    if (*spec++ != ','){
+      return -1;
+    }
+  }
+  return -1;
+}
+
+static void formatSize(size_t size, char *out, size_t outSize){
+  if (size >= (1 << 30) && size % (1 << 30) == 0){
+    snprintf(out, outSize, "%zuG", size >> 30);
+  } else if (size >= (1 << 20) && size % (1 << 20) == 0){
+    snprintf(out, outSize, "%zuM", size >> 20);
+  } else if (size >= (1 << 10) && size % (1 << 10) == 0){
+    snprintf(out, outSize, "%zuk", size >> 10);
+  } else {
+    snprintf(out, outSize, "%zu", size);
+  }
+}
+
+// time stamp counter ticks per nanosecond, measured against the monotonic clock
+static double measureTsc(void){
+  long long startNs = nowNs();
+  uint64_t startTicks = __rdtsc();
+  while (nowNs() - startNs < 100000000LL){
+  }
+  return (double) (__rdtsc() - startTicks) / (nowNs() - startNs);
+}
+
+// warn about what makes counter ticks differ from core cycles: a governor that changes the frequency, turbo
+static void checkFrequency(int cpu){
+  char path[128], governor[64] = "";
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", cpu);
+  FILE *file = fopen(path, "r");
+  if (file == NULL){
+    printf("cpu %d: no cpufreq, the frequency can't be checked\n", cpu);
+    return;
+  }
+  if (fgets(governor, sizeof(governor), file) != NULL){
+    governor[strcspn(governor, "\n")] = '\0';
+  }
+  fclose(file);
+  printf("cpu %d: governor %s\n", cpu, governor);
+  if (strcmp(governor, "performance") != 0){
+    printf("warning: pin the frequency for stable numbers (cpupower frequency-set -g performance, turbo off)\n");
+  }
+}
+
+static void runOperation(const struct variant *variant, enum operation operation, char *text, const char *key, size_t length){
+  switch (operation){
+    case OPERATION_ENCRYPT:
+      variant->encrypt(text, key, length);
+      break;
+    case OPERATION_DECRYPT:
+      variant->decrypt(text, key, length);
+      break;
+    case OPERATION_VALIDATE:
+      sink += variant->findInvalid(text, length);
+      break;
+    case OPERATION_ENCRYPT_SYMBOLS:
+      variant->encryptSymbols(text, key, length);
+      break;
+    case OPERATION_DECRYPT_SYMBOLS:
+      variant->decryptSymbols(text, key, length);
+      break;
+    case OPERATION_TO_SYMBOLS:
+      variant->toSymbols(text, key, length);
+      break;
+    case OPERATION_TO_TEXT:
+      variant->toText(text, key, length);
+      break;
+    case OPERATION_PACK:
+      variant->pack(text, length);
+      break;
+    case OPERATION_UNPACK:
+      variant->unpack(text, length);
+      break;
+  }
+}
+
+// What an operation runs on: the buffer it changes starts as a copy of *input, *second is its key (or source).
+// Packing and unpacking go over their own output again on every pass, which costs the same as the first one.
+static void operationInput(enum operation operation, const struct benchData *data, const char **input, const char **second){
+  switch (operation){
+    case OPERATION_ENCRYPT: case OPERATION_DECRYPT: case OPERATION_VALIDATE:
+      *input = data->text;
+      *second = data->key;
+      break;
+    case OPERATION_ENCRYPT_SYMBOLS: case OPERATION_DECRYPT_SYMBOLS: case OPERATION_PACK: case OPERATION_UNPACK:
+      *input = data->textSymbols;
+      *second = data->keySymbols;
+      break;
+    case OPERATION_TO_SYMBOLS:
+      *input = data->textSymbols;
+      *second = data->text;
+      break;
+    case OPERATION_TO_TEXT:
+      *input = data->text;
+      *second = data->keySymbols;
+      break;
+  }
+}
+
+static int compareDoubles(const void *a, const void *b){
+  double x = *(const double*) a, y = *(const double*) b;
+  return x < y ? -1 : x > y;
+}
+
+// passes over the buffer per repetition so that one takes about MIN_MEASURE_NS, after warming up for WARMUP_NS
+static long calibrate(const struct variant *variant, enum operation operation, char *text, const char *key, size_t length){
+  long passes = 0;
+  long long start = nowNs(), elapsed;
+  do {
+    runOperation(variant, operation, text, key, length);
+    passes++;
+  } while ((elapsed = nowNs() - start) < WARMUP_NS);
+  long perRepeat = (long) ((double) passes * MIN_MEASURE_NS / elapsed);
+  return perRepeat > 0 ? perRepeat : 1;
+}
+
+// median over the repetitions of ticks per character and nanoseconds per character
+static void measure(const struct variant *variant, enum operation operation, char *text, const char *key, size_t length,
+                    int repeats, double *ticksPerChar, double *nsPerChar){
+  double ticks[MAX_REPEATS], ns[MAX_REPEATS];
+  long passes = calibrate(variant, operation, text, key, length);
+  for (int r = 0; r < repeats; r++){
+    long long startNs = nowNs();
+    uint64_t startTicks = __rdtsc();
+    for (long p = 0; p < passes; p++){
+      runOperation(variant, operation, text, key, length);
+    }
+    ticks[r] = (double) (__rdtsc() - startTicks) / ((double) passes * length);
+    ns[r] = (double) (nowNs() - startNs) / ((double) passes * length);
+  }
+  qsort(ticks, repeats, sizeof(double), compareDoubles);
+  qsort(ns, repeats, sizeof(double), compareDoubles);
+  *ticksPerChar = ticks[repeats / 2];
+  *nsPerChar = ns[repeats / 2];
+}
+
+// report a variant whose output differs from the reference's
+static int differs(const struct variant *variant, const char *what, const char *expected, const char *actual, size_t length){
+  if (memcmp(expected, actual, length) == 0){
+    return 0;
+  }
+  fprintf(stderr, "%s: %s differs from the reference\n", variant->name, what);
+  return 1;
+}
+
+// the variant has to give the reference's output on the same input, returns 0 if it does
+static int verify(const struct variant *variant, const struct variant *reference, const struct benchData *data,
+                  size_t length, char *expected, char *actual){
+  int failed = 0;
+  memcpy(expected, data->text, length);
+  memcpy(actual, data->text, length);
+  reference->encrypt(expected, data->key, length);
+  variant->encrypt(actual, data->key, length);
+  failed |= differs(variant, "encrypt", expected, actual, length);
+  reference->decrypt(expected, data->key, length);
+  variant->decrypt(actual, data->key, length);
+  failed |= differs(variant, "decrypt", expected, actual, length) || differs(variant, "decrypt", data->text, actual, length);
+  //a bad character at the start, in the middle, in the tail the vector loops leave to scalar code, and none at all
+  size_t positions[] = { 0, length / 2, length - 1, length };
+  for (size_t i = 0; i < sizeof(positions) / sizeof(positions[0]); i++){
+    memcpy(actual, data->text, length);
+    if (positions[i] < length){
+      actual[positions[i]] = (i % 2 == 0) ? '@' : '[';      //the neighbours of 'A' and 'Z'
+    }
+    size_t want = reference->findInvalid(actual, length), got = variant->findInvalid(actual, length);
+    if (want != got){
+      fprintf(stderr, "%s: validate found %zu instead of %zu\n", variant->name, got, want);
+      failed = 1;
+    }
+  }
+
+  memcpy(expected, data->textSymbols, length);
+  memcpy(actual, data->textSymbols, length);
+  reference->encryptSymbols(expected, data->keySymbols, length);
+  variant->encryptSymbols(actual, data->keySymbols, length);
+  failed |= differs(variant, "sym-enc", expected, actual, length);
+  reference->decryptSymbols(expected, data->keySymbols, length);
+  variant->decryptSymbols(actual, data->keySymbols, length);
+  failed |= differs(variant, "sym-dec", expected, actual, length) || differs(variant, "sym-dec", data->textSymbols, actual, length);
+  //bad characters become spaces, in place as the clients convert
+  memcpy(expected, data->text, length);
+  for (size_t i = 0; i < sizeof(positions) / sizeof(positions[0]) - 1; i++){
+    expected[positions[i]] = "@[\x80"[i];
+  }
+  memcpy(actual, expected, length);
+  reference->toSymbols(expected, expected, length);
+  variant->toSymbols(actual, actual, length);
+  failed |= differs(variant, "to-sym", expected, actual, length);
+  memcpy(expected, data->keySymbols, length);
+  memcpy(actual, data->keySymbols, length);
+  reference->toText(expected, expected, length);
+  variant->toText(actual, actual, length);
+  failed |= differs(variant, "to-text", expected, actual, length) || differs(variant, "to-text", data->key, actual, length);
+  //a last group of 3, 2 and 1 symbols, and a value no symbols give in the middle
+  for (size_t cut = 0; cut < 3 && cut < length; cut++){
+    size_t symbols = length - cut, packed = OTP_PACKED_SIZE(symbols);
+    memcpy(expected, data->textSymbols, symbols);
+    memcpy(actual, data->textSymbols, symbols);
+    reference->pack(expected, symbols);
+    variant->pack(actual, symbols);
+    failed |= differs(variant, "pack", expected, actual, packed);
+    size_t middle = packed / 4 * 2;
+    expected[middle] = actual[middle] = (char) 0xff;
+    expected[middle + 1] = actual[middle + 1] = (char) 0xff;
+    reference->unpack(expected, symbols);
+    variant->unpack(actual, symbols);
+    failed |= differs(variant, "unpack", expected, actual, symbols);
+  }
+  return failed;
+}
+
+int main(int argc, char *argv[]){
+  const char *sizeSpec = DEFAULT_SIZES;
+  const char *kernelSpec = NULL;
+  int cpu = -1;
+  int repeats = DEFAULT_REPEATS;
+  int option;
+  char *end = NULL;
+  while ((option = getopt(argc, argv, "s:k:c:r:")) != -1){
+    switch (option){
+      case 's':
+        sizeSpec = optarg;
+        break;
+      case 'k':
+        kernelSpec = optarg;
+        break;
+      case 'c':
+        cpu = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || cpu < 0 || cpu >= CPU_SETSIZE){
+          usage(argv[0]);
+        }
+        break;
+      case 'r':
+        repeats = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || repeats < 1 || repeats > MAX_REPEATS){
+          usage(argv[0]);
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind != argc){
+    usage(argv[0]);
+  }
+  size_t sizes[MAX_SIZES];
+  int sizeCount = parseSizes(sizeSpec, sizes);
+  if (sizeCount < 0){
+    usage(argv[0]);
+  }
+  otpKernelInit();
+
+  struct variant variants[1 + KERNEL_NAMES];
+  int variantCount = 0;
+  variants[variantCount++] = (struct variant) { "reference", encryptReference, decryptReference, findInvalidReference,
+                                                encryptSymbolsReference, decryptSymbolsReference, toSymbolsReference,
+                                                toTextReference, packReference, unpackReference };
+  for (size_t i = 0; i < KERNEL_NAMES; i++){
+    if (kernelSpec != NULL){      //only the ones asked for, by whole name
+      size_t length = strlen(kernelNames[i]);
+      const char *found = strstr(kernelSpec, kernelNames[i]);
+      if (found == NULL || (found != kernelSpec && found[-1] != ',') || (found[length] != ',' && found[length] != '\0')){
+        continue;
+      }
+    }
+    const struct otpKernel *kernel = otpKernelFind(kernelNames[i]);
+    if (kernel == NULL){
+      printf("%s: not supported by this CPU\n", kernelNames[i]);
+      continue;
+    }
+    variants[variantCount++] = (struct variant) { kernel->name, kernel->encrypt, kernel->decrypt, kernel->findInvalid,
+                                                  kernel->encryptSymbols, kernel->decryptSymbols, kernel->toSymbols,
+                                                  kernel->toText, kernel->pack, kernel->unpack };
+  }
+
+  //one core, so the counter and the caches we measure are the same all the way through
+  if (cpu < 0){
+    cpu = sched_getcpu();
+  }
+  cpu_set_t cores;
+  CPU_ZERO(&cores);
+  CPU_SET(cpu, &cores);
+  if (sched_setaffinity(0, sizeof(cores), &cores) < 0){
+    err(1, "can't pin to cpu %d", cpu);
+  }
+  checkFrequency(cpu);
+  double ticksPerNs = measureTsc();
+  printf("time stamp counter: %.3f GHz (chars/tick below counts its ticks, not core cycles)\n\n", ticksPerNs);
+
+  size_t largest = 0;
+  for (int i = 0; i < sizeCount; i++){
+    largest = sizes[i] > largest ? sizes[i] : largest;
+  }
+  //+ 1: unpacking needs a byte more than the symbols
+  struct benchData data;
+  data.key = malloc(largest);
+  data.text = malloc(largest);
+  data.keySymbols = malloc(largest);
+  data.textSymbols = malloc(largest);
+  char *expected = malloc(largest + 1), *actual = malloc(largest + 1);
+  if (data.key == NULL || data.text == NULL || data.keySymbols == NULL || data.textSymbols == NULL
+      || expected == NULL || actual == NULL){
+    err(1, "can't allocate buffers of %zu bytes", largest);
+  }
+  unsigned char seed[OTP_RANDOM_KEY_SIZE];
+  if (otpRandomKey(seed) < 0){
+    err(1, "no entropy");
+  }
+  struct otpRandom random;
+  otpRandomInit(&random, seed, 0);
+  otpRandomText(&random, data.key, largest);
+  otpRandomInit(&random, seed, 1);
+  otpRandomText(&random, data.text, largest);
+  toSymbolsReference(data.keySymbols, data.key, largest);
+  toSymbolsReference(data.textSymbols, data.text, largest);
+
+  int failed = 0;
+  printf("%-8s %-9s %-10s %12s %10s %9s\n", "size", "operation", "variant", "chars/tick", "GB/s", "speedup");
+  for (int s = 0; s < sizeCount; s++){
+    char sizeName[32];
+    formatSize(sizes[s], sizeName, sizeof(sizeName));
+    for (int v = 1; v < variantCount; v++){
+      failed |= verify(&variants[v], &variants[0], &data, sizes[s], expected, actual);
+    }
+    for (int o = OPERATION_ENCRYPT; o <= OPERATION_UNPACK; o++){
+      double referenceNs = 0;
+      const char *input, *second;
+      operationInput(o, &data, &input, &second);
+      for (int v = 0; v < variantCount; v++){
+        double ticksPerChar, nsPerChar;
+        memcpy(actual, input, sizes[s]);       //validation has to run over the whole buffer
+        measure(&variants[v], o, actual, second, sizes[s], repeats, &ticksPerChar, &nsPerChar);
+        if (v == 0){
+          referenceNs = nsPerChar;
+        }
+        printf("%-8s %-9s %-10s %12.3f %10.2f %8.1fx\n", sizeName, operationNames[o], variants[v].name,
+               1 / ticksPerChar, 1 / nsPerChar, referenceNs / nsPerChar);
+      }
+    }
+    printf("\n");
+  }
+  printf(failed ? "FAILED: a variant differs from the reference\n" : "every variant matches the reference byte for byte\n");
+  return failed;
+}
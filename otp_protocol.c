@@ -0,0 +1,87 @@
+#include <string.h>
+
+#include "otp_protocol.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+static void putBig(unsigned char *out, uint64_t value, int bytes){
+  for (int i = bytes - 1; i >= 0; i--){
+    out[i] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+static uint64_t getBig(const unsigned char *in, int bytes){
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++){
+    value = (value << 8) | in[i];
+  }
+  return value;
+}
+
+void otpEncodeHeader(const struct otpHeader *header, unsigned char *out){
+  memset(out, '\0', OTP_HEADER_SIZE);
+  putBig(out, header->magic, 4);
+  out[4] = header->version;
+  out[5] = header->flags;
+  putBig(out + 6, header->status, 2);
+  putBig(out + 8, header->requestId, 4);
+  putBig(out + 12, header->padId, 4);
+  putBig(out + 16, header->keyLength, 8);
+  putBig(out + 24, header->textLength, 8);
+}
+
+int otpDecodeHeader(const unsigned char *in, struct otpHeader *header){
+  header->magic = getBig(in, 4);
+  header->version = in[4];
+  header->flags = in[5];
+  header->status = getBig(in + 6, 2);
+  header->requestId = getBig(in + 8, 4);
+  header->padId = getBig(in + 12, 4);
+  header->keyLength = getBig(in + 16, 8);
+  header->textLength = getBig(in + 24, 8);
+  return header->padId == 0 || (header->flags & OTP_FLAG_PAD) ? 0 : -1;
+}
+
+uint64_t otpWireLength(const struct otpHeader *header, uint64_t length){
+  return (header->flags & OTP_FLAG_PACKED) ? OTP_PACKED_SIZE(length) : length;
+}
+
+uint64_t otpRequestBodyLength(const struct otpHeader *header){
+  if (header->flags & OTP_FLAG_SHARED){         //sharing the region itself has no body
+    return header->textLength > 0 ? OTP_SHARED_BODY_SIZE : 0;
+  }
+  uint64_t keyBytes = (header->flags & OTP_FLAG_PAD) ? 0 : otpWireLength(header, header->keyLength);
+  return keyBytes + otpWireLength(header, header->textLength);
+}
+
+uint64_t otpResponseBodyLength(const struct otpHeader *header){
+  return (header->flags & OTP_FLAG_SHARED) ? 0 : otpWireLength(header, header->textLength);
+}
+
+void otpEncodeSharedBody(uint64_t keyOffset, uint64_t textOffset, unsigned char *out){
+  putBig(out, keyOffset, 8);
+  putBig(out + 8, textOffset, 8);
+}
+
+void otpDecodeSharedBody(const unsigned char *in, uint64_t *keyOffset, uint64_t *textOffset){
+  *keyOffset = getBig(in, 8);
+  *textOffset = getBig(in + 8, 8);
+}
+
+const char *otpStatusText(int status){
+  switch (status){
+    case OTP_STATUS_OK:            return "ok";
+    case OTP_STATUS_WRONG_SERVER:  return "wrong server";
+    case OTP_STATUS_BAD_VERSION:   return "unsupported protocol version";
+    case OTP_STATUS_UNSUPPORTED:   return "unsupported request flags";
+    case OTP_STATUS_KEY_TOO_SHORT: return "key is shorter than the text";
+    case OTP_STATUS_TOO_LARGE:     return "message too large";
+    case OTP_STATUS_BAD_REQUEST:   return "malformed request";
+    case OTP_STATUS_NO_SUCH_PAD:   return "no such pad segment";
+    case OTP_STATUS_PAD_USED:      return "pad segment already used";
+  }
+  return "unknown status";
+}
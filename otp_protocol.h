@@ -0,0 +1,146 @@
+#ifndef OTP_PROTOCOL_H
+#define OTP_PROTOCOL_H
+
+#include <stdint.h>
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* Binary wire protocol spoken by enc_client/dec_client and the servers.
+*
+* A request is a fixed 32 byte header followed by keyLength key bytes and textLength text bytes,
+* the server answers with a header of its own followed by textLength result bytes. Everything
+* is sent in one shot, there are no acknowledgements in between. With OTP_FLAG_KEEPALIVE a
+* connection carries any number of request/response pairs one after another.
+*
+* Clients may pipeline: send further requests without waiting for the earlier responses. Every
+* response carries the requestId of its request. Requests with OTP_FLAG_MULTIPLEX may be answered
+* out of order and in fragments (OTP_FLAG_MORE on all but the last one), so a large response
+* doesn't hold back the small ones queued behind it. Responses to requests without that flag
+* are sent whole and in request order.
+*
+* With OTP_FLAG_STREAM the body is sent in chunks of OTP_STREAM_CHUNK: the key bytes of a chunk
+* followed by its text bytes, then the next chunk (the last one may be shorter, keyLength has to
+* equal textLength). The server transforms every chunk as soon as it has arrived and answers it
+* with a fragment of its own (or a few chunks at a time, in one fragment at the offset of the
+* first), so neither side has to hold the whole message in memory.
+*
+* With OTP_FLAG_PAD the key isn't sent at all: the server uses the segment of its pad padId that
+* starts at the offset given in keyLength (OTP_PAD_OFFSET_ANY lets an encryption server pick the
+* next unused one), the body is only the text. The response starts with a frame flagged
+* OTP_FLAG_PAD that carries no result bytes, its keyLength is the pad offset that was used.
+*
+* With OTP_FLAG_PACKED key, text and result travel packed: every 3 symbols of the alphabet ('A' = 0,
+* ' ' = 26) are one big endian 16 bit value s0 * 729 + s1 * 27 + s2, n characters take
+* OTP_PACKED_SIZE(n) bytes. Lengths and offsets in the headers still count characters, fragments
+* and stream chunks (OTP_PACKED_STREAM_CHUNK) start on whole groups. A client finds out whether
+* the server packs by sending an empty packed request first, a server that doesn't know the flag
+* answers it with OTP_STATUS_UNSUPPORTED. Response frames of packed requests carry the flag too.
+*
+* With OTP_FLAG_SHARED (Unix socket connections only) key and text don't travel at all. The client
+* first shares a memory region: a request with no text that carries a sealed memfd (F_SEAL_SHRINK)
+* passed with SCM_RIGHTS, answered with OTP_STATUS_OK (or OTP_STATUS_UNSUPPORTED where the server
+* can't map it). After that the body of a shared request is OTP_SHARED_BODY_SIZE bytes, the offsets
+* of its key and its text in the region (otpEncodeSharedBody), the server writes the result over the
+* text and answers with a frame flagged OTP_FLAG_SHARED that carries no result bytes.
+*
+* The first byte of every header is 'O' (the magic is "OTPE"/"OTPD"/"OTPR"), while the old
+* lockstep protocol starts with the single 't'/'p' test message, so the server can tell the
+* two apart from the first byte and keeps serving old clients.
+*
+*  offset  size  field
+*       0     4  magic        OTP_MAGIC_* (big endian)
+*       4     1  version      OTP_PROTOCOL_VERSION
+*       5     1  flags        OTP_FLAG_*, unknown flags are answered with OTP_STATUS_UNSUPPORTED
+*       6     2  status       OTP_STATUS_* (responses only)
+*       8     4  requestId    chosen by the client, echoed in the response
+*      12     4  padId        pad the key comes from (OTP_FLAG_PAD only, 0 otherwise)
+*      16     8  keyLength    key chars following the header (OTP_FLAG_PAD: pad offset, responses: offset of this fragment in the result)
+*      24     8  textLength   text/result chars following the key
+*/
+
+#define OTP_HEADER_SIZE 32
+#define OTP_PROTOCOL_VERSION 1
+
+#define OTP_MAGIC_ENCRYPT 0x4f545045u     // "OTPE", request for enc_server
+#define OTP_MAGIC_DECRYPT 0x4f545044u     // "OTPD", request for dec_server
+#define OTP_MAGIC_RESULT  0x4f545052u     // "OTPR", response
+#define OTP_MAGIC_FIRST_BYTE 'O'          // what tells a binary request apart from the 't'/'p' test message
+
+// request: keep the connection open for more requests after this one
+// response: more frames follow on this connection, without it this is the last frame before the server closes
+#define OTP_FLAG_KEEPALIVE 0x01
+// request: the response may be sent out of order and in fragments
+#define OTP_FLAG_MULTIPLEX 0x02
+// response: more fragments of this response follow
+#define OTP_FLAG_MORE 0x04
+// request: key and text are interleaved in OTP_STREAM_CHUNK chunks, the response comes back chunk by chunk
+#define OTP_FLAG_STREAM 0x08
+// request: the key is a segment of a pad kept by the server, response: the frame announces the pad offset used
+#define OTP_FLAG_PAD 0x10
+// request/response: key, text and result are packed 3 characters to 2 bytes
+#define OTP_FLAG_PACKED 0x20
+
+// request/response: key, text and result are in the region shared over the Unix socket
+#define OTP_FLAG_SHARED 0x40
+
+#define OTP_FLAGS_SUPPORTED (OTP_FLAG_KEEPALIVE | OTP_FLAG_MULTIPLEX | OTP_FLAG_STREAM | OTP_FLAG_PAD | OTP_FLAG_PACKED | OTP_FLAG_SHARED)
+
+#define OTP_PAD_OFFSET_ANY UINT64_MAX
+
+#define OTP_STREAM_CHUNK 65536
+#define OTP_PACKED_STREAM_CHUNK 65535           // whole groups of 3
+
+#define OTP_SHARED_BODY_SIZE 16                 // key offset and text offset in the shared region
+
+// bytes that n characters take packed
+#define OTP_PACKED_SIZE(n) ((n) / 3 * 2 + ((n) % 3 != 0 ? 2 : 0))
+
+enum otpStatus {
+  OTP_STATUS_OK = 0,
+  OTP_STATUS_WRONG_SERVER = 1,      // e.g. enc_client talking to dec_server
+  OTP_STATUS_BAD_VERSION = 2,       // the response carries the version the server speaks
+  OTP_STATUS_UNSUPPORTED = 3,       // the request uses flags the server doesn't know
+  OTP_STATUS_KEY_TOO_SHORT = 4,
+  OTP_STATUS_TOO_LARGE = 5,         // the server can't hold a message that large
+  OTP_STATUS_BAD_REQUEST = 6,
+  OTP_STATUS_NO_SUCH_PAD = 7,       // unknown pad or the segment is outside of it
+  OTP_STATUS_PAD_USED = 8           // the segment was already used for encryption (or the pad is used up)
+};
+
+struct otpHeader {
+  uint32_t magic;
+  uint8_t version;
+  uint8_t flags;
+  uint16_t status;
+  uint32_t requestId;
+  uint32_t padId;
+  uint64_t keyLength;
+  uint64_t textLength;
+};
+
+// serialize header into OTP_HEADER_SIZE bytes in network byte order
+void otpEncodeHeader(const struct otpHeader *header, unsigned char *out);
+
+// parse OTP_HEADER_SIZE bytes, returns 0 on success, -1 if a padId is given without OTP_FLAG_PAD
+int otpDecodeHeader(const unsigned char *in, struct otpHeader *header);
+
+// bytes `length` key/text chars take on the wire (packed or not, by the flags of the header)
+uint64_t otpWireLength(const struct otpHeader *header, uint64_t length);
+
+// bytes of key and text (or shared offsets) that follow a request header
+uint64_t otpRequestBodyLength(const struct otpHeader *header);
+
+// result bytes that follow a response header
+uint64_t otpResponseBodyLength(const struct otpHeader *header);
+
+// the body of a shared request: where its key and its text are in the region
+void otpEncodeSharedBody(uint64_t keyOffset, uint64_t textOffset, unsigned char *out);
+void otpDecodeSharedBody(const unsigned char *in, uint64_t *keyOffset, uint64_t *textOffset);
+
+// human readable text for a status
+const char *otpStatusText(int status);
+
+#endif
@@ -0,0 +1,182 @@
+#include <string.h>
+#include <sys/random.h>
+#include <errno.h>
+#include <pthread.h>
+#include <immintrin.h>
+
+#include "otp_random.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+#define SYMBOLS 27
+#define ACCEPT_BELOW (SYMBOLS * (256 / SYMBOLS))      // 243, the largest multiple of 27 a byte can hold
+#define WIDE_BATCH (16 * 64)                           // 16 ChaCha20 blocks, what the AVX-512 version makes at once
+
+static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+/*---------------------------------------------------------------------------------------------------*/
+// ChaCha20 (the original layout: 64-bit block counter, 64-bit nonce used as the stream number) on
+// several consecutive blocks at once, every vector holds the same word of all of them. The same
+// code is built for 4 blocks (SSE2), 8 (AVX2) and 16 (AVX-512) blocks per call.
+
+#define QUARTER_ROUND(a, b, c, d) \
+  a += b; d ^= a; d = (d << 16) | (d >> 16); \
+  c += d; b ^= c; b = (b << 12) | (b >> 20); \
+  a += b; d ^= a; d = (d << 8) | (d >> 24);  \
+  c += d; b ^= c; b = (b << 7) | (b >> 25);
+
+#define CHACHA_BLOCKS(name, blocks, isa) \
+typedef uint32_t name##Lanes __attribute__((vector_size(4 * (blocks)))); \
+__attribute__((target(isa))) \
+static void name(const uint32_t input[16], uint64_t counter, unsigned char *bytes){ \
+  name##Lanes start[16], x[16]; \
+  for (int i = 0; i < 16; i++){ \
+    for (int block = 0; block < (blocks); block++){ \
+      start[i][block] = input[i]; \
+    } \
+  } \
+  for (int block = 0; block < (blocks); block++){ \
+    start[12][block] = (uint32_t) (counter + block); \
+    start[13][block] = (uint32_t) ((counter + block) >> 32); \
+  } \
+  memcpy(x, start, sizeof(x)); \
+  for (int round = 0; round < 20; round += 2){ \
+    QUARTER_ROUND(x[0], x[4], x[8],  x[12]); \
+    QUARTER_ROUND(x[1], x[5], x[9],  x[13]); \
+    QUARTER_ROUND(x[2], x[6], x[10], x[14]); \
+    QUARTER_ROUND(x[3], x[7], x[11], x[15]); \
+    QUARTER_ROUND(x[0], x[5], x[10], x[15]); \
+    QUARTER_ROUND(x[1], x[6], x[11], x[12]); \
+    QUARTER_ROUND(x[2], x[7], x[8],  x[13]); \
+    QUARTER_ROUND(x[3], x[4], x[9],  x[14]); \
+  } \
+  for (int i = 0; i < 16; i++){ \
+    x[i] += start[i]; \
+  } \
+  for (int block = 0; block < (blocks); block++){       /* back to block order, little endian words */ \
+    for (int i = 0; i < 16; i++){ \
+      uint32_t word = x[i][block]; \
+      memcpy(bytes + 64 * block + 4 * i, &word, 4); \
+    } \
+  } \
+}
+
+CHACHA_BLOCKS(chacha4, 4, "sse2")
+CHACHA_BLOCKS(chacha8, 8, "avx2")
+CHACHA_BLOCKS(chacha16, 16, "avx512f")
+
+int otpRandomKey(unsigned char key[OTP_RANDOM_KEY_SIZE]){
+  size_t filled = 0;
+  while (filled < OTP_RANDOM_KEY_SIZE){
+    ssize_t got = getrandom(key + filled, OTP_RANDOM_KEY_SIZE - filled, 0);
+    if (got < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      return -1;
+    }
+    filled += got;
+  }
+  return 0;
+}
+
+void otpRandomInit(struct otpRandom *random, const unsigned char key[OTP_RANDOM_KEY_SIZE], uint64_t stream){
+  random->input[0] = 0x61707865;      //"expand 32-byte k"
+  random->input[1] = 0x3320646e;
+  random->input[2] = 0x79622d32;
+  random->input[3] = 0x6b206574;
+  memcpy(&random->input[4], key, OTP_RANDOM_KEY_SIZE);
+  random->input[12] = random->input[13] = 0;
+  random->input[14] = (uint32_t) stream;
+  random->input[15] = (uint32_t) (stream >> 32);
+}
+
+void otpRandomBytes(struct otpRandom *random, unsigned char bytes[OTP_RANDOM_BATCH]){
+  uint64_t counter = random->input[12] | (uint64_t) random->input[13] << 32;
+  chacha4(random->input, counter, bytes);
+  counter += OTP_RANDOM_BATCH / 64;
+  random->input[12] = (uint32_t) counter;
+  random->input[13] = (uint32_t) (counter >> 32);
+}
+
+// as many bytes as the widest ChaCha20 the CPU has makes at once (a multiple of OTP_RANDOM_BATCH), returns how many
+static size_t randomBlocks(struct otpRandom *random, unsigned char bytes[WIDE_BATCH]){
+  uint64_t counter = random->input[12] | (uint64_t) random->input[13] << 32;
+  size_t produced;
+  if (__builtin_cpu_supports("avx512f")){
+    chacha16(random->input, counter, bytes);
+    produced = 16 * 64;
+  } else if (__builtin_cpu_supports("avx2")){
+    chacha8(random->input, counter, bytes);
+    produced = 8 * 64;
+  } else {
+    chacha4(random->input, counter, bytes);
+    produced = 4 * 64;
+  }
+  counter += produced / 64;
+  random->input[12] = (uint32_t) counter;
+  random->input[13] = (uint32_t) (counter >> 32);
+  return produced;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// rejection sampling: keep the bytes below 243 as characters, writes up to 64 bytes past what it returns
+
+static char characterOf[256];         // alphabet[byte % 27] for the bytes that are kept
+
+static size_t acceptScalar(const unsigned char *bytes, size_t count, char *out){
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++){     //no branch: always write, only move on when the byte is kept
+    out[kept] = characterOf[bytes[i]];
+    kept += bytes[i] < ACCEPT_BELOW;
+  }
+  return kept;
+}
+
+__attribute__((target("avx512bw,avx512vbmi,avx512vbmi2")))
+static size_t acceptVBMI2(const unsigned char *bytes, size_t count, char *out){
+  __m512i table0 = _mm512_loadu_si512(characterOf), table1 = _mm512_loadu_si512(characterOf + 64);
+  __m512i table2 = _mm512_loadu_si512(characterOf + 128), table3 = _mm512_loadu_si512(characterOf + 192);
+  size_t kept = 0, i = 0;
+  for (; i + 64 <= count; i += 64){
+    __m512i random = _mm512_loadu_si512(bytes + i);
+    __mmask64 accept = _mm512_cmplt_epu8_mask(random, _mm512_set1_epi8((char) ACCEPT_BELOW));
+    __m512i low = _mm512_permutex2var_epi8(table0, random, table1);       //bytes 0..127
+    __m512i high = _mm512_permutex2var_epi8(table2, random, table3);      //bytes 128..255
+    __m512i characters = _mm512_mask_blend_epi8(_mm512_movepi8_mask(random), low, high);
+    _mm512_storeu_si512(out + kept, _mm512_maskz_compress_epi8(accept, characters));
+    kept += __builtin_popcountll(accept);
+  }
+  return kept + acceptScalar(bytes + i, count - i, out + kept);
+}
+
+static size_t (*acceptBytes)(const unsigned char *bytes, size_t count, char *out);
+static pthread_once_t acceptOnce = PTHREAD_ONCE_INIT;      //keygen -T fills texts on several threads at once
+
+static void initAccept(void){
+  __builtin_cpu_init();
+  for (int byte = 0; byte < 256; byte++){
+    characterOf[byte] = alphabet[byte % SYMBOLS];
+  }
+  acceptBytes = __builtin_cpu_supports("avx512vbmi2") && __builtin_cpu_supports("avx512vbmi") ? acceptVBMI2 : acceptScalar;
+}
+
+void otpRandomText(struct otpRandom *random, char *text, size_t length){
+  unsigned char bytes[WIDE_BATCH];
+  char batch[WIDE_BATCH + 64];
+  pthread_once(&acceptOnce, initAccept);
+  size_t filled = 0;
+  while (filled < length){
+    size_t produced = randomBlocks(random, bytes);
+    if (length - filled >= sizeof(batch)){          //room for the overrun, straight into the text
+      filled += acceptBytes(bytes, produced, text + filled);
+      continue;
+    }
+    size_t kept = acceptBytes(bytes, produced, batch);
+    size_t take = kept < length - filled ? kept : length - filled;
+    memcpy(text + filled, batch, take);
+    filled += take;
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef OTP_RANDOM_H
+#define OTP_RANDOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* Key material for keygen: a ChaCha20 stream cipher keyed with 32 bytes from getrandom(), so
+* every run gets a different key (two keygens started in the same second no longer agree).
+* The same key gives 2^64 independent streams, selected by a stream number.
+*
+* Random bytes become characters of the alphabet by rejection sampling: bytes >= 243 (= 9 * 27)
+* are dropped, the rest map to byte % 27, so all 27 characters are equally likely. ChaCha20 runs
+* on 4 blocks at once, and on CPUs with AVX-512 VBMI2 the mapping and the dropping are done on 64
+* bytes at a time (table lookup with vpermb, compaction with vpcompressb).
+*/
+
+#define OTP_RANDOM_KEY_SIZE 32
+#define OTP_RANDOM_BATCH 256            // 4 ChaCha20 blocks
+
+struct otpRandom {
+  uint32_t input[16];             // constants, key, 64-bit block counter, 64-bit stream number
+};
+
+// fill key with fresh entropy from the kernel, returns -1 with errno set if there is none
+int otpRandomKey(unsigned char key[OTP_RANDOM_KEY_SIZE]);
+
+// start a stream: different stream numbers under the same key never overlap
+void otpRandomInit(struct otpRandom *random, const unsigned char key[OTP_RANDOM_KEY_SIZE], uint64_t stream);
+
+// the next OTP_RANDOM_BATCH bytes of the stream
+void otpRandomBytes(struct otpRandom *random, unsigned char bytes[OTP_RANDOM_BATCH]);
+
+// fill text with length characters of the alphabet, every one of them equally likely
+void otpRandomText(struct otpRandom *random, char *text, size_t length);
+
+#endif
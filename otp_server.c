@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server_engine.h"
+#include "otp_kernel.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* Encryption and decryption server on one port
+* Every binary request picks the operation with the magic of its header ("OTPE" encrypts, "OTPD"
+* decrypts), old clients with their test message ('t' encrypts, 'p' decrypts), so enc_client and
+* dec_client can both talk to it and one set of workers serves both kinds of traffic.
+*/
+
+int main(int argc, char *argv[]){
+  struct serverConfig config;
+  otpKernelInit();
+  parseServerOptions(argc, argv, &config);    // Check usage & args
+
+  addServerOperation(&config, &otpEncryptOperation);
+  addServerOperation(&config, &otpDecryptOperation);
+  return runServer(&config);
+}
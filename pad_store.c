@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pad_store.h"
+#include "otp_kernel.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+#define LEDGER_RECORD 16
+#define LEASE_MIN (64 * 1024)               //chars of a process's first lease of a pad
+#define LEASE_MAX (16 * 1024 * 1024)        //leases double up to this
+#define LEDGER_SUFFIX ".ledger"
+
+static void putBig(unsigned char *out, uint64_t value){
+  for (int i = 7; i >= 0; i--){
+    out[i] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+static uint64_t getBig(const unsigned char *in){
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++){
+    value = (value << 8) | in[i];
+  }
+  return value;
+}
+
+// add a range to the sorted list of consumed ranges, merging it with the ones it touches
+static int addRange(struct pad *pad, uint64_t start, uint64_t end){
+  if (start >= end){
+    return 0;
+  }
+  size_t first = 0;
+  while (first < pad->consumedCount && pad->consumed[first].end < start){
+    first++;
+  }
+  size_t last = first;
+  while (last < pad->consumedCount && pad->consumed[last].start <= end){
+    if (pad->consumed[last].start < start){
+      start = pad->consumed[last].start;
+    }
+    if (pad->consumed[last].end > end){
+      end = pad->consumed[last].end;
+    }
+    last++;
+  }
+  if (first == last){           //touches nothing, make room for a new range
+    if (pad->consumedCount == pad->consumedCapacity){
+      size_t capacity = pad->consumedCapacity ? 2 * pad->consumedCapacity : 16;
+      struct padRange *larger = realloc(pad->consumed, capacity * sizeof(struct padRange));
+      if (larger == NULL){
+        return -1;
+      }
+      pad->consumed = larger;
+      pad->consumedCapacity = capacity;
+    }
+    memmove(pad->consumed + first + 1, pad->consumed + first, (pad->consumedCount - first) * sizeof(struct padRange));
+    pad->consumedCount++;
+  } else {                      //replace the ranges first..last-1 with the merged one
+    memmove(pad->consumed + first + 1, pad->consumed + last, (pad->consumedCount - last) * sizeof(struct padRange));
+    pad->consumedCount -= last - first - 1;
+  }
+  pad->consumed[first].start = start;
+  pad->consumed[first].end = end;
+  return 0;
+}
+
+// merge what other processes appended to the ledger since we last looked (a torn last record is ignored)
+static int readLedger(struct pad *pad){
+  unsigned char records[256 * LEDGER_RECORD];
+  while (1){
+    ssize_t bytesRead = pread(pad->ledgerFD, records, sizeof(records), pad->ledgerRead);
+    if (bytesRead < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      return -1;
+    }
+    size_t complete = (size_t) bytesRead / LEDGER_RECORD;
+    for (size_t i = 0; i < complete; i++){
+      uint64_t start = getBig(records + i * LEDGER_RECORD);
+      uint64_t length = getBig(records + i * LEDGER_RECORD + 8);
+      if (addRange(pad, start, start + length) < 0){
+        return -1;
+      }
+    }
+    pad->ledgerRead += complete * LEDGER_RECORD;
+    if ((size_t) bytesRead < sizeof(records)){
+      return 0;
+    }
+  }
+}
+
+static int lockLedger(struct pad *pad, int type){
+  struct flock lock;
+  memset(&lock, '\0', sizeof(lock));
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;       //l_start = l_len = 0: the whole file
+  while (fcntl(pad->ledgerFD, F_SETLKW, &lock) < 0){
+    if (errno != EINTR){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int padStoreAdd(struct padStore *store, const char *path){
+  struct pad pad;
+  memset(&pad, '\0', sizeof(pad));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0){
+    return -1;
+  }
+  struct stat info;
+  if (fstat(fd, &info) < 0){
+    close(fd);
+    return -1;
+  }
+  if (info.st_size == 0){
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  char *data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED){
+    return -1;
+  }
+  const char *newline = memchr(data, '\n', info.st_size);
+  pad.data = data;
+  pad.length = newline != NULL ? (uint64_t) (newline - data) : (uint64_t) info.st_size;
+  if (otpFindInvalid(pad.data, pad.length) < pad.length){     //checked once here instead of on every request
+    munmap(data, info.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  char *ledgerPath = malloc(strlen(path) + sizeof(LEDGER_SUFFIX));
+  struct pad *larger = realloc(store->pads, (store->count + 1) * sizeof(struct pad));
+  if (ledgerPath == NULL || larger == NULL){
+    free(ledgerPath);
+    munmap(data, info.st_size);
+    errno = ENOMEM;
+    return -1;
+  }
+  store->pads = larger;
+  strcpy(ledgerPath, path);
+  strcat(ledgerPath, LEDGER_SUFFIX);
+  pad.ledgerFD = open(ledgerPath, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  free(ledgerPath);
+  //drop a record torn by a crash, the next one has to start on a record boundary
+  if (pad.ledgerFD < 0 || lockLedger(&pad, F_WRLCK) < 0 || readLedger(&pad) < 0 || ftruncate(pad.ledgerFD, pad.ledgerRead) < 0){
+    if (pad.ledgerFD >= 0){
+      close(pad.ledgerFD);
+    }
+    free(pad.consumed);
+    munmap(data, info.st_size);
+    return -1;
+  }
+  lockLedger(&pad, F_UNLCK);
+  pad.leaseSize = LEASE_MIN;
+  store->pads[store->count] = pad;
+  return store->count++;
+}
+
+const char *padKey(const struct padStore *store, uint32_t id, uint64_t offset, uint64_t length){
+  if (store == NULL || id >= store->count){
+    return NULL;
+  }
+  const struct pad *pad = &store->pads[id];
+  if (offset > pad->length || length > pad->length - offset){
+    return NULL;
+  }
+  return pad->data + offset;
+}
+
+// first unused segment of at least length chars, PAD_OFFSET_ANY if there is none
+static uint64_t findUnused(const struct pad *pad, uint64_t length){
+  uint64_t start = 0;
+  for (size_t i = 0; i < pad->consumedCount; i++){
+    if (pad->consumed[i].start - start >= length){
+      break;
+    }
+    start = pad->consumed[i].end;
+  }
+  return pad->length - start >= length ? start : PAD_OFFSET_ANY;
+}
+
+// unused chars from start up to the next consumed range or the end of the pad
+static uint64_t unusedFrom(const struct pad *pad, uint64_t start){
+  uint64_t end = pad->length;
+  for (size_t i = 0; i < pad->consumedCount; i++){
+    if (pad->consumed[i].end > start){
+      end = pad->consumed[i].start;
+      break;
+    }
+  }
+  return start < end ? end - start : 0;
+}
+
+// the segment is what is left of this process's lease
+static int inLease(const struct pad *pad, uint64_t start, uint64_t length){
+  return start >= pad->leaseNext && start <= pad->leaseEnd && length <= pad->leaseEnd - start;
+}
+
+int padConsume(struct padStore *store, uint32_t id, uint64_t *offset, uint64_t length){
+  if (store == NULL || id >= store->count){
+    return -1;
+  }
+  struct pad *pad = &store->pads[id];
+  uint64_t start = *offset == PAD_OFFSET_ANY ? pad->leaseNext : *offset;
+  if (length > 0 && inLease(pad, start, length)){       //no ledger write, the lease is on disk already
+    pad->leaseNext = start + length;
+    *offset = start;
+    return 0;
+  }
+  if (lockLedger(pad, F_WRLCK) < 0){
+    return -1;
+  }
+  int result = -1;
+  if (readLedger(pad) == 0){
+    uint64_t rest = pad->leaseEnd - pad->leaseNext;
+    if (*offset != PAD_OFFSET_ANY){
+      start = *offset;
+    } else if (rest > 0 && length > rest && unusedFrom(pad, pad->leaseEnd) >= length - rest){     //the lease can grow to fit it
+      start = pad->leaseNext;
+    } else {
+      start = findUnused(pad, length);
+    }
+    //a segment that starts in the lease only needs the range right after it
+    uint64_t from = start >= pad->leaseNext && start < pad->leaseEnd ? pad->leaseEnd : start;
+    uint64_t unused = start != PAD_OFFSET_ANY && from <= pad->length ? unusedFrom(pad, from) : 0;
+    if (length == 0 && padKey(store, id, start, 0) != NULL){
+      *offset = start;
+      result = 0;
+    } else if (length > 0 && unused >= length - (from - start)){
+      //lease more than this request, the next ones are handed out of it without a write
+      uint64_t needed = length - (from - start);
+      uint64_t lease = needed > pad->leaseSize ? needed : pad->leaseSize;
+      lease = lease < unused ? lease : unused;
+      unsigned char record[LEDGER_RECORD];
+      putBig(record, from);
+      putBig(record + 8, lease);
+      //the record has to be on disk before the segment is used, otherwise a crash could hand it out again
+      if (write(pad->ledgerFD, record, LEDGER_RECORD) == LEDGER_RECORD && fdatasync(pad->ledgerFD) == 0){
+        pad->ledgerRead += LEDGER_RECORD;
+        addRange(pad, from, from + lease);
+        pad->leaseNext = start + length;          //the rest of an earlier lease is given up unless it grew
+        pad->leaseEnd = from + lease;
+        pad->leaseSize = pad->leaseSize < LEASE_MAX ? 2 * pad->leaseSize : LEASE_MAX;
+        *offset = start;
+        result = 0;
+      } else {
+        ftruncate(pad->ledgerFD, pad->ledgerRead);      //don't leave half a record behind
+      }
+    }
+  }
+  lockLedger(pad, F_UNLCK);
+  return result;
+}
@@ -0,0 +1,61 @@
+#ifndef PAD_STORE_H
+#define PAD_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* Pads kept by the server, so a request can name a pad segment instead of carrying the key.
+* Every pad is a keygen file (the key characters followed by a \n), memory mapped read-only
+* and identified by its position on the command line (the first -k is pad 0).
+*
+* Encryption consumes the segment it uses. Consumed ranges are appended to <pad file>.ledger,
+* records of two big endian 64-bit numbers (offset, length), which is synced to disk before the
+* segment is used. A segment is never handed out twice, not even after a restart. The ledger is
+* locked with fcntl() while it is read and extended, so prefork workers and forked children can
+* share a pad.
+*
+* A process doesn't record every segment: it leases a larger range (64k chars at first, doubling
+* up to 16M) with one record and one sync, and hands out the following segments from it without
+* touching the disk. What is left of a lease when the process exits is never used.
+*/
+
+struct padRange {
+  uint64_t start, end;            // [start, end)
+};
+
+struct pad {
+  const char *data;               // the mapped key characters
+  uint64_t length;
+  int ledgerFD;
+  uint64_t ledgerRead;            // bytes of the ledger already merged into consumed
+  struct padRange *consumed;      // sorted, merged
+  size_t consumedCount, consumedCapacity;
+  uint64_t leaseNext, leaseEnd;   // [leaseNext, leaseEnd): what this process hasn't handed out of its lease
+  uint64_t leaseSize;             // chars of the next lease
+};
+
+struct padStore {
+  struct pad *pads;
+  uint32_t count;
+};
+
+#define PAD_OFFSET_ANY UINT64_MAX     // let padConsume() pick the first unused segment
+
+// map a pad file and open its ledger, returns its pad id or -1 (errno set, EINVAL if it isn't a valid pad)
+int padStoreAdd(struct padStore *store, const char *path);
+
+// the key characters of [offset, offset + length) of a pad, NULL if there is no such pad or range
+const char *padKey(const struct padStore *store, uint32_t id, uint64_t offset, uint64_t length);
+
+// Record [*offset, *offset + length) as consumed, with *offset == PAD_OFFSET_ANY the next segment of
+// the lease (or of a new one at the first unused range that is long enough) is picked and stored in
+// *offset. Returns 0 once the segment is on disk, in a lease recorded earlier or now, -1 if the segment
+// was already consumed (or the pad has no room left) or the ledger can't be written.
+int padConsume(struct padStore *store, uint32_t id, uint64_t *offset, uint64_t length);
+
+#endif
@@ -0,0 +1,662 @@
+#define _GNU_SOURCE             // accept4(), sched_setaffinity()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <signal.h>
+#include <syslog.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <time.h>
+
+#include "server_engine.h"
+#include "otp_kernel.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+#define MAX_EVENTS 256          // epoll events handled per wakeup
+#define DEFAULT_IDLE_TIMEOUT 60 // seconds
+#define RESPAWN_BACKOFF 1       // seconds to wait before respawning a worker that died right after starting
+#define DEFAULT_PARALLEL_THRESHOLD (4 * 1024 * 1024)      // chars, smaller texts aren't worth waking up other threads
+#define ADMIN_BACKLOG 16
+
+static volatile sig_atomic_t stopRequested = 0;     // set by SIGTERM/SIGINT in the prefork master
+
+const struct otpOperation otpEncryptOperation = {
+  't',                  // old enc_clients introduce themselves with 't'
+  OTP_MAGIC_ENCRYPT,
+  otpEncrypt,
+  otpEncryptSymbols,
+  1                     // a pad segment encrypts only one message
+};
+
+const struct otpOperation otpDecryptOperation = {
+  'p',                  // old dec_clients introduce themselves with 'p'
+  OTP_MAGIC_DECRYPT,
+  otpDecrypt,
+  otpDecryptSymbols,
+  0
+};
+
+// Error function used for reporting issues
+static void error(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+// Set up the address struct for the server socket
+static void setupAddressStruct(struct sockaddr_in* address,
+                               int portNumber){
+
+  memset((char*) address, '\0', sizeof(*address));  // Clear out the address struct
+
+  address->sin_family = AF_INET;                    // The address should be network capable
+  address->sin_port = htons(portNumber);            // Store the port number
+  address->sin_addr.s_addr = INADDR_ANY;            // Allow a client at any address to connect to this server
+}
+
+//CITATION: Chapter 60.3 The Linux Programming Interface
+static void grimReaper(int sig){
+    (void) sig;
+    int savedErrno;
+    /* Save 'errno' in case changed here */
+    savedErrno = errno;
+    while (waitpid(-1, NULL, WNOHANG) > 0){ //reap all dead child processes
+      continue;
+    }
+    errno = savedErrno;
+}
+
+static void setNonBlocking(int fd){
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0){
+    error("ERROR setting O_NONBLOCK");
+  }
+}
+
+// allow as many open connections as the hard limit permits (the default soft limit is 1024)
+static void raiseFileLimit(){
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max){
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+static void usage(const char *program){
+  fprintf(stderr,"USAGE: %s [-m event|prefork|fork] [-w workers] [-b backlog] [-i idle_seconds] [-r max_requests] [-k pad_file]... [-t parallel_threshold] [-T threads] [-u socket_path] [-a admin_port|admin_socket_path] [-x trace_file] <port>\n", program);
+  exit(1);
+}
+
+// parse an integer option in [minimum, maximum], exits with usage on anything else
+static long parseNumber(const char *text, long minimum, long maximum, const char *program){
+  char *end = NULL;
+  long value = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || value < minimum || value > maximum){
+    usage(program);
+  }
+  return value;
+}
+
+void addServerOperation(struct serverConfig *config, const struct otpOperation *operation){
+  if (config->service.operationCount < MAX_SERVICE_OPERATIONS){
+    config->service.operations[config->service.operationCount++] = operation;
+  }
+}
+
+void parseServerOptions(int argc, char *argv[], struct serverConfig *config){
+  int option;
+  memset(config, '\0', sizeof(*config));
+  config->mode = SERVER_MODE_EVENT;
+  config->backlog = SOMAXCONN;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  config->workers = cores > 0 ? (int) cores : 1;
+  config->idleTimeout = DEFAULT_IDLE_TIMEOUT;
+  config->service.parallelThreshold = DEFAULT_PARALLEL_THRESHOLD;
+
+  while ((option = getopt(argc, argv, "m:w:b:i:r:k:t:T:u:a:x:")) != -1){
+    switch (option){
+      case 'm':
+        if (strcmp(optarg, "event") == 0){
+          config->mode = SERVER_MODE_EVENT;
+        } else if (strcmp(optarg, "prefork") == 0){
+          config->mode = SERVER_MODE_PREFORK;
+        } else if (strcmp(optarg, "fork") == 0){
+          config->mode = SERVER_MODE_FORK;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'w':
+        config->workers = parseNumber(optarg, 1, 65535, argv[0]);
+        break;
+      case 'b':
+        config->backlog = parseNumber(optarg, 1, 65535, argv[0]);
+        break;
+      case 'i':
+        config->idleTimeout = parseNumber(optarg, 0, 86400, argv[0]);
+        break;
+      case 'r':
+        config->service.maxRequests = parseNumber(optarg, 0, LONG_MAX, argv[0]);
+        break;
+      case 'k':           //pad ids follow the order of the -k options
+        if (padStoreAdd(&config->pads, optarg) < 0){
+          err(1, "Can't load pad %s", optarg);
+        }
+        config->service.pads = &config->pads;
+        break;
+      case 't':
+        config->service.parallelThreshold = parseNumber(optarg, 0, LONG_MAX, argv[0]);
+        break;
+      case 'T':
+        config->service.transformThreads = parseNumber(optarg, 1, 1024, argv[0]);
+        break;
+      case 'u':
+        config->localPath = optarg;
+        break;
+      case 'a':
+        config->adminAddress = optarg;
+        break;
+      case 'x':
+        config->tracePath = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind >= argc) {       //check if port wasn't provided
+    usage(argv[0]);
+  }
+  config->port = atoi(argv[optind]);
+  //-T is per process: prefork workers split the cores between their pools instead of each taking all of them
+  if (config->service.transformThreads == 0){        //no -T
+    int threads = cores > 0 ? (int) cores : 1;
+    if (config->mode == SERVER_MODE_PREFORK){
+      threads /= config->workers;
+    }
+    config->service.transformThreads = threads > 0 ? threads : 1;
+  }
+  //made before anything forks, so every worker and child adds to the same numbers
+  if (config->adminAddress != NULL && (config->service.metrics = metricsCreate()) == NULL){
+    error("ERROR mapping the metrics");
+  }
+  if (config->tracePath != NULL && (config->service.trace = traceCreate()) == NULL){
+    error("ERROR mapping the trace");
+  }
+}
+
+// reusePort puts the socket in a SO_REUSEPORT group, the kernel then spreads new connections across the group
+static int createListenSocket(int port, int backlog, int reusePort){
+  struct sockaddr_in serverAddress;
+  int listenSocket = socket(AF_INET, SOCK_STREAM, 0);       // Create the socket that will listen for connections
+  if (listenSocket < 0) {
+    error("ERROR opening socket");
+  }
+  int enable = 1;
+  setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));   // allow quick restarts on the same port
+  if (reusePort && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0){
+    error("ERROR setting SO_REUSEPORT");
+  }
+
+  setupAddressStruct(&serverAddress, port);        // Set up the address struct for the server socket
+
+  // Associate the socket to the port
+  if (bind(listenSocket,
+          (struct sockaddr *)&serverAddress,
+          sizeof(serverAddress)) < 0){
+    error("ERROR on binding");
+  }
+  if (listen(listenSocket, backlog) < 0){     // Start listening for connetions. Allow up to backlog connections to queue up
+    error("ERROR on listen");
+  }
+  return listenSocket;
+}
+
+// the Unix socket next to the TCP port, -1 without -u
+static int createLocalSocket(const char *path, int backlog){
+  struct sockaddr_un address;
+  if (path == NULL){
+    return -1;
+  }
+  memset((char*) &address, '\0', sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)){
+    fprintf(stderr, "ERROR socket path too long\n");
+    exit(1);
+  }
+  strcpy(address.sun_path, path);
+  int localSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (localSocket < 0){
+    error("ERROR opening socket");
+  }
+  unlink(path);           //left behind by an earlier server
+  if (bind(localSocket, (struct sockaddr *) &address, sizeof(address)) < 0){
+    error("ERROR on binding");
+  }
+  if (listen(localSocket, backlog) < 0){
+    error("ERROR on listen");
+  }
+  return localSocket;
+}
+
+// the admin endpoint: a Unix socket if the address is a path, otherwise a port on the loopback interface only
+static int createAdminSocket(const char *address){
+  if (strchr(address, '/') != NULL){
+    return createLocalSocket(address, ADMIN_BACKLOG);
+  }
+  struct sockaddr_in serverAddress;
+  int adminSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (adminSocket < 0){
+    error("ERROR opening socket");
+  }
+  int enable = 1;
+  setsockopt(adminSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  setupAddressStruct(&serverAddress, atoi(address));
+  serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);       // nobody else needs to scrape us
+  if (bind(adminSocket, (struct sockaddr *) &serverAddress, sizeof(serverAddress)) < 0){
+    error("ERROR on binding the admin port");
+  }
+  if (listen(adminSocket, ADMIN_BACKLOG) < 0){
+    error("ERROR on listen");
+  }
+  return adminSocket;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// event mode: every connection is a state machine driven by a single epoll loop
+
+// connections ordered by their last activity, the least recently active one first,
+// so closing idle connections only ever looks at the front of the list
+struct idleList {
+  struct connection *head, *tail;
+};
+
+static long now(){
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &time);
+  return time.tv_sec;
+}
+
+static void idleRemove(struct idleList *list, struct connection *conn){
+  if (conn->idlePrev != NULL){
+    conn->idlePrev->idleNext = conn->idleNext;
+  } else {
+    list->head = conn->idleNext;
+  }
+  if (conn->idleNext != NULL){
+    conn->idleNext->idlePrev = conn->idlePrev;
+  } else {
+    list->tail = conn->idlePrev;
+  }
+  conn->idlePrev = conn->idleNext = NULL;
+}
+
+// mark a connection as just active by moving it to the back of the list
+static void idleTouch(struct idleList *list, struct connection *conn, long time){
+  if (list->tail != conn){
+    if (conn->idlePrev != NULL || conn->idleNext != NULL || list->head == conn){
+      idleRemove(list, conn);
+    }
+    conn->idlePrev = list->tail;
+    if (list->tail != NULL){
+      list->tail->idleNext = conn;
+    } else {
+      list->head = conn;
+    }
+    list->tail = conn;
+  }
+  conn->lastActive = time;
+}
+
+// translate what the connection waits for into epoll events
+static uint32_t epollEvents(int wanted){
+  return ((wanted & CONNECTION_WANTS_READ) ? EPOLLIN : 0) | ((wanted & CONNECTION_WANTS_WRITE) ? EPOLLOUT : 0);
+}
+
+static void updateInterest(int epollFD, struct connection *conn, int *wanted){
+  int events = connectionEvents(conn);
+  if (events == *wanted){
+    return;
+  }
+  struct epoll_event event;
+  event.events = epollEvents(events);
+  event.data.ptr = conn;
+  epoll_ctl(epollFD, EPOLL_CTL_MOD, conn->fd, &event);
+  *wanted = events;
+}
+
+// accept every pending connection and register it with epoll
+static void acceptConnections(int epollFD, int listenSocket, const struct otpService *service, struct idleList *idle){
+  while (1){
+    int connectionSocket = accept4(listenSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connectionSocket < 0){
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED){
+        syslog(LOG_ERR, "Can't accept connection (%s)", strerror(errno));
+        metricsAdd(service->metrics, METRIC_CONNECTIONS_REJECTED, 1);
+      }
+      if (errno == EINTR || errno == ECONNABORTED){
+        continue;
+      }
+      return;                   // no more pending connections (or out of descriptors, retry on the next wakeup)
+    }
+    metricsAdd(service->metrics, METRIC_CONNECTIONS_ACCEPTED, 1);
+    struct connection *conn = connectionCreate(connectionSocket, service);
+    if (conn == NULL){
+      metricsAdd(service->metrics, METRIC_CONNECTIONS_REJECTED, 1);
+      close(connectionSocket);
+      continue;
+    }
+    struct epoll_event event;
+    event.events = epollEvents(connectionEvents(conn));
+    event.data.ptr = conn;
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, connectionSocket, &event) < 0){
+      metricsAdd(service->metrics, METRIC_CONNECTIONS_REJECTED, 1);
+      connectionDestroy(conn);
+      close(connectionSocket);
+      continue;
+    }
+    idleTouch(idle, conn, now());
+  }
+}
+
+static void closeConnection(int epollFD, struct connection *conn, struct idleList *idle){
+  idleRemove(idle, conn);
+  epoll_ctl(epollFD, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  connectionDestroy(conn);
+}
+
+// localSocket: the Unix socket (-1 without one), prefork workers all wait on the same one
+static int runEventLoop(int listenSocket, int localSocket, const struct serverConfig *config){
+  struct epoll_event events[MAX_EVENTS];
+  struct idleList idle = { NULL, NULL };
+  int epollFD = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFD < 0){
+    error("ERROR creating epoll instance");
+  }
+  setNonBlocking(listenSocket);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;      // NULL marks the listening sockets
+  if (epoll_ctl(epollFD, EPOLL_CTL_ADD, listenSocket, &event) < 0){
+    error("ERROR registering listening socket");
+  }
+  if (localSocket >= 0){
+    setNonBlocking(localSocket);
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;      // wake one worker per connection, not all of them
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, localSocket, &event) < 0){
+      error("ERROR registering listening socket");
+    }
+  }
+
+  while (1){
+    // wake up at least once a second to close idle connections
+    int ready = epoll_wait(epollFD, events, MAX_EVENTS, config->idleTimeout > 0 ? 1000 : -1);
+    if (ready < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      error("ERROR on epoll_wait");
+    }
+    long time = now();
+    for (int i = 0; i < ready; i++){
+      struct connection *conn = events[i].data.ptr;
+      if (conn == NULL){
+        acceptConnections(epollFD, listenSocket, &config->service, &idle);
+        if (localSocket >= 0){
+          acceptConnections(epollFD, localSocket, &config->service, &idle);
+        }
+        continue;
+      }
+      int wanted = connectionEvents(conn);
+      if (connectionProcess(conn) < 0){     // done or failed, either way the client is gone
+        closeConnection(epollFD, conn, &idle);
+        continue;
+      }
+      updateInterest(epollFD, conn, &wanted);
+      idleTouch(&idle, conn, time);
+    }
+    while (config->idleTimeout > 0 && idle.head != NULL && time - idle.head->lastActive >= config->idleTimeout){
+      closeConnection(epollFD, idle.head, &idle);
+    }
+  }
+  close(epollFD);
+  return 0;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// fork mode: a child per connection runs the same state machine with poll()
+
+static void serveConnection(int connectionSocket, const struct serverConfig *config){
+  struct connection *conn = connectionCreate(connectionSocket, &config->service);
+  if (conn == NULL){
+    metricsAdd(config->service.metrics, METRIC_CONNECTIONS_REJECTED, 1);
+    return;
+  }
+  setNonBlocking(connectionSocket);
+  int timeout = config->idleTimeout > 0 ? config->idleTimeout * 1000 : -1;
+  while (connectionProcess(conn) == 0){
+    struct pollfd waitFor;
+    waitFor.fd = connectionSocket;
+    int wanted = connectionEvents(conn);
+    waitFor.events = ((wanted & CONNECTION_WANTS_READ) ? POLLIN : 0) | ((wanted & CONNECTION_WANTS_WRITE) ? POLLOUT : 0);
+    int ready = poll(&waitFor, 1, timeout);
+    if (ready == 0 || (ready < 0 && errno != EINTR)){      // idle for too long or broken
+      break;
+    }
+  }
+  connectionDestroy(conn);
+}
+
+static int runForkLoop(int listenSocket, int localSocket, const struct serverConfig *config){
+  struct sigaction reaper;
+  memset(&reaper, '\0', sizeof(reaper));
+  reaper.sa_handler = grimReaper;       // reap dead child processes (connections) as soon as they exit
+  reaper.sa_flags = SA_RESTART;
+  sigemptyset(&reaper.sa_mask);
+  sigaction(SIGCHLD, &reaper, NULL);
+
+  // Accept a connection, blocking if one is not available until one connects
+  while(1){
+    int acceptSocket = listenSocket;
+    if (localSocket >= 0){      //wait for either of them
+      struct pollfd waitFor[2] = { { listenSocket, POLLIN, 0 }, { localSocket, POLLIN, 0 } };
+      if (poll(waitFor, 2, -1) < 0){
+        continue;
+      }
+      acceptSocket = (waitFor[1].revents & POLLIN) ? localSocket : listenSocket;
+    }
+    // Accept the connection request which creates a connection socket
+    int connectionSocket = accept(acceptSocket, NULL, NULL);
+    if (connectionSocket < 0){
+      if (errno == EINTR || errno == ECONNABORTED){
+        continue;
+      }
+      error("ERROR on accept");
+    }
+    metricsAdd(config->service.metrics, METRIC_CONNECTIONS_ACCEPTED, 1);
+
+    // CITATION: the logic and structure of forking has been adapted from the Chapter 60.3 of The Linux Programming Interface
+    switch (fork()) {
+      case -1:    //fail
+        syslog(LOG_ERR, "Can't create child (%s)", strerror(errno));
+        metricsAdd(config->service.metrics, METRIC_CONNECTIONS_REJECTED, 1);
+        close(connectionSocket);
+        break;                        // May be temporary; try next client
+      case 0:     //child
+        traceAttach(config->service.trace, -1);
+        close(listenSocket);
+        if (localSocket >= 0){
+          close(localSocket);
+        }
+        serveConnection(connectionSocket, config);
+        close(connectionSocket);      // Close the connection socket for this client
+        _exit(0);
+      default:    // Parent
+        close(connectionSocket);      // Unneeded copy of connected socket
+        break;
+    }
+  }
+  return 0;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// prefork mode: a master keeps N event loop workers alive, worker i owns listening socket i
+
+static void requestStop(int sig){
+  (void) sig;
+  stopRequested = 1;
+}
+
+// keep worker i on core i so its connections stay in that core's caches
+static void pinToCore(int worker){
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores <= 0){
+    return;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(worker % cores, &cpus);
+  sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
+static pid_t spawnWorker(int worker, const int *listenSockets, int localSocket, const struct serverConfig *config){
+  int workers = config->workers;
+  pid_t pid = fork();
+  if (pid == -1){
+    syslog(LOG_ERR, "Can't create worker %d (%s)", worker, strerror(errno));
+    return -1;
+  }
+  if (pid == 0){
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    for (int i = 0; i < workers; i++){     // the other workers' sockets are none of our business
+      if (i != worker){
+        close(listenSockets[i]);
+      }
+    }
+    pinToCore(worker);
+    traceAttach(config->service.trace, worker);
+    _exit(runEventLoop(listenSockets[worker], localSocket, config));
+  }
+  return pid;
+}
+
+static int runPreforkPool(const struct serverConfig *config){
+  int workers = config->workers;
+  int *listenSockets = calloc(workers, sizeof(int));
+  pid_t *pids = calloc(workers, sizeof(pid_t));
+  time_t *started = calloc(workers, sizeof(time_t));
+  if (listenSockets == NULL || pids == NULL || started == NULL){
+    error("ERROR allocating workers");
+  }
+
+  // The master owns every socket of the SO_REUSEPORT group, so connections queued on a socket
+  // survive the death of its worker and get served by the replacement.
+  for (int i = 0; i < workers; i++){
+    listenSockets[i] = createListenSocket(config->port, config->backlog, 1);
+  }
+  int localSocket = createLocalSocket(config->localPath, config->backlog);    // one for all of them
+
+  struct sigaction stop;
+  memset(&stop, '\0', sizeof(stop));
+  stop.sa_handler = requestStop;          // no SA_RESTART, wait() has to return so we notice
+  sigemptyset(&stop.sa_mask);
+  sigaction(SIGTERM, &stop, NULL);
+  sigaction(SIGINT, &stop, NULL);
+
+  for (int i = 0; i < workers; i++){
+    pids[i] = spawnWorker(i, listenSockets, localSocket, config);
+    started[i] = time(NULL);
+  }
+
+  while (!stopRequested){
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      if (errno == ECHILD){         // every fork failed, try again after a while
+        sleep(RESPAWN_BACKOFF);
+      }
+    }
+    for (int i = 0; i < workers; i++){
+      if (pids[i] != pid && pids[i] != -1){
+        continue;
+      }
+      if (pid > 0 && pids[i] == pid){
+        syslog(LOG_ERR, "Worker %d (pid %d) exited with status %d, respawning", i, (int) pid, status);
+      }
+      if (time(NULL) - started[i] < RESPAWN_BACKOFF){    // don't spin if a worker keeps dying on startup
+        sleep(RESPAWN_BACKOFF);
+      }
+      pids[i] = spawnWorker(i, listenSockets, localSocket, config);
+      started[i] = time(NULL);
+    }
+  }
+
+  for (int i = 0; i < workers; i++){
+    if (pids[i] > 0){
+      kill(pids[i], SIGTERM);
+    }
+  }
+  while (wait(NULL) > 0){     // reap them all before leaving
+    continue;
+  }
+  for (int i = 0; i < workers; i++){
+    close(listenSockets[i]);
+  }
+  if (localSocket >= 0){
+    close(localSocket);
+  }
+  free(listenSockets);
+  free(pids);
+  free(started);
+  return 0;
+}
+
+int runServer(const struct serverConfig *config){
+  signal(SIGPIPE, SIG_IGN);           // a client hanging up must not kill the server
+  raiseFileLimit();
+  //first, no other thread may exist yet when SIGUSR1 gets blocked
+  if (config->tracePath != NULL && traceWatchSignal(config->service.trace, config->tracePath) < 0){
+    error("ERROR starting the trace dumper");
+  }
+  if (config->adminAddress != NULL
+      && metricsServe(config->service.metrics, config->service.trace, createAdminSocket(config->adminAddress)) < 0){
+    error("ERROR starting the admin endpoint");
+  }
+  if (config->mode == SERVER_MODE_PREFORK){
+    return runPreforkPool(config);
+  }
+  int listenSocket = createListenSocket(config->port, config->backlog, 0);
+  int localSocket = createLocalSocket(config->localPath, config->backlog);
+  int result;
+  if (config->mode == SERVER_MODE_FORK){
+    result = runForkLoop(listenSocket, localSocket, config);
+  } else {
+    result = runEventLoop(listenSocket, localSocket, config);
+  }
+  close(listenSocket);      // Close the listening socket
+  if (localSocket >= 0){
+    close(localSocket);
+  }
+  return result;
+}
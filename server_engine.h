@@ -0,0 +1,54 @@
+#ifndef SERVER_ENGINE_H
+#define SERVER_ENGINE_H
+
+#include "connection.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* Listening side shared by enc_server, dec_server and otp_server.
+* event:   one process multiplexes all connections with epoll (default)
+* prefork: N long-lived event loop workers, each with its own SO_REUSEPORT listening socket
+* fork:    the original fork-per-connection server
+* With -u the server also listens on a Unix socket, in every mode; local clients skip TCP there
+* and can share a memory region with the server (OTP_FLAG_SHARED).
+* With -a the server collects metrics and serves them on an admin port or socket (server_metrics.h).
+* With -x it traces every request, SIGUSR1 (or GET /trace on the admin endpoint) dumps it (server_trace.h).
+*/
+
+enum serverMode {
+  SERVER_MODE_EVENT,
+  SERVER_MODE_PREFORK,
+  SERVER_MODE_FORK
+};
+
+struct serverConfig {
+  int port;
+  const char *localPath;          // -u: also listen on this Unix socket (NULL: TCP only)
+  const char *adminAddress;       // -a: serve metrics on this loopback port or Unix socket path (NULL: no metrics)
+  const char *tracePath;          // -x: trace requests, SIGUSR1 writes the trace here (NULL: no tracing)
+  enum serverMode mode;
+  int workers;                    // prefork: number of worker processes (default: one per online core)
+  int backlog;                    // listen() backlog (default: SOMAXCONN)
+  int idleTimeout;                // seconds a connection may stay silent before it is closed (0 = never)
+  struct otpService service;      // service.maxRequests is set from -r
+  struct padStore pads;           // pads loaded with -k, service.pads points here when there are any
+};
+
+// what enc_server and dec_server do, otp_server offers both on one port
+extern const struct otpOperation otpEncryptOperation;
+extern const struct otpOperation otpDecryptOperation;
+
+// add an operation to the service config serves
+void addServerOperation(struct serverConfig *config, const struct otpOperation *operation);
+
+// parse "[-m event|prefork|fork] [-w workers] [-b backlog] [-i idle] [-r requests] [-k pad_file]... [-t threshold] [-T threads] [-u socket_path] [-a admin] [-x trace_file] <port>" into config,
+// prints usage and exits on bad arguments (otpKernelInit() has to be called first, the pads are checked with it)
+void parseServerOptions(int argc, char *argv[], struct serverConfig *config);
+
+// serve forever
+int runServer(const struct serverConfig *config);
+
+#endif
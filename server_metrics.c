@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "server_metrics.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+#define ADMIN_REQUEST_MAX 4096          // request line and headers, the body of a GET is ignored
+#define ADMIN_TIMEOUT 1                 // seconds a scraper may take to send its request / read the answer
+#define METRICS_OUTPUT 65536            // enough for everything we export
+
+struct counterInfo {
+  const char *name;
+  const char *type;
+  const char *help;
+};
+
+static const struct counterInfo counterInfos[METRIC_COUNTERS] = {
+  { "otp_connections_accepted_total", "counter", "Connections accepted." },
+  { "otp_connections_rejected_total", "counter", "Connections dropped right after accept (no descriptors, memory or process for them)." },
+  { "otp_connections_active", "gauge", "Connections being served." },
+  { "otp_requests_total", "counter", "Requests served (a streamed request counts once)." },
+  { "otp_requests_refused_total", "counter", "Requests answered with an error status." },
+  { "otp_received_bytes_total", "counter", "Bytes read from clients." },
+  { "otp_sent_bytes_total", "counter", "Bytes written to clients." },
+  { "otp_handshake_failures_total", "counter", "Clients with the wrong test message, magic or protocol version." },
+  { "otp_short_reads_total", "counter", "Reads that returned less than the message needed." },
+  { "otp_short_writes_total", "counter", "Writes that took less than was queued." },
+};
+
+static const char *phaseNames[METRIC_PHASES] = { "handshake", "key", "text", "transform", "send" };
+
+// upper bounds of the exported buckets in nanoseconds, 1-2.5-5 steps from 1us to 10s
+static const uint64_t bucketBounds[] = {
+  1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+  1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 500000000,
+  1000000000, 2500000000ULL, 5000000000ULL, 10000000000ULL
+};
+#define BUCKET_BOUNDS (sizeof(bucketBounds) / sizeof(bucketBounds[0]))
+
+struct serverMetrics *metricsCreate(void){
+  struct serverMetrics *metrics = mmap(NULL, sizeof(struct serverMetrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  return metrics == MAP_FAILED ? NULL : metrics;      //zeroed by the kernel
+}
+
+uint64_t metricsClock(const struct serverMetrics *metrics){
+  if (metrics == NULL){
+    return 0;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void metricsAdd(struct serverMetrics *metrics, enum metricsCounter counter, int64_t amount){
+  if (metrics != NULL){
+    __atomic_fetch_add(&metrics->counters[counter], (uint64_t) amount, __ATOMIC_RELAXED);
+  }
+}
+
+void metricsRecordPhase(struct serverMetrics *metrics, enum metricsPhase phase, uint64_t since){
+  if (metrics != NULL && since != 0){
+    histogramRecordAtomic(&metrics->phases[phase], metricsClock(metrics) - since);
+  }
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// Prometheus text format
+
+struct output {
+  char *buffer;
+  size_t size, length;
+};
+
+static void append(struct output *out, const char *format, ...){
+  va_list arguments;
+  va_start(arguments, format);
+  int written = out->length < out->size ? vsnprintf(out->buffer + out->length, out->size - out->length, format, arguments)
+                                        : vsnprintf(NULL, 0, format, arguments);    //full, only count
+  va_end(arguments);
+  if (written > 0){
+    out->length += written;
+  }
+}
+
+size_t metricsFormat(const struct serverMetrics *metrics, char *buffer, size_t size){
+  struct output out = { buffer, size, 0 };
+  for (int i = 0; i < METRIC_COUNTERS; i++){
+    const struct counterInfo *info = &counterInfos[i];
+    uint64_t value = __atomic_load_n(&metrics->counters[i], __ATOMIC_RELAXED);
+    append(&out, "# HELP %s %s\n# TYPE %s %s\n", info->name, info->help, info->name, info->type);
+    if (i == METRIC_CONNECTIONS_ACTIVE){
+      append(&out, "%s %lld\n", info->name, (long long) (int64_t) value);
+    } else {
+      append(&out, "%s %llu\n", info->name, (unsigned long long) value);
+    }
+  }
+  //the exported buckets are sums of the fine ones, a value sits in the bucket its fine bucket ends in
+  append(&out, "# HELP otp_phase_duration_seconds Time spent in each phase of a request.\n");
+  append(&out, "# TYPE otp_phase_duration_seconds histogram\n");
+  for (int p = 0; p < METRIC_PHASES; p++){
+    const struct histogram *histogram = &metrics->phases[p];
+    for (size_t b = 0; b < BUCKET_BOUNDS; b++){
+      append(&out, "otp_phase_duration_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n", phaseNames[p],
+             bucketBounds[b] / 1e9, (unsigned long long) histogramCountAtOrBelow(histogram, bucketBounds[b]));
+    }
+    uint64_t total = __atomic_load_n(&histogram->total, __ATOMIC_RELAXED);
+    append(&out, "otp_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", phaseNames[p], (unsigned long long) total);
+    append(&out, "otp_phase_duration_seconds_sum{phase=\"%s\"} %.9f\n", phaseNames[p],
+           __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) / 1e9);
+    append(&out, "otp_phase_duration_seconds_count{phase=\"%s\"} %llu\n", phaseNames[p], (unsigned long long) total);
+  }
+  //the tail the coarse buckets can't show, from the fine ones
+  append(&out, "# HELP otp_phase_duration_quantile_seconds Percentiles of the phase durations (1/64 precision).\n");
+  append(&out, "# TYPE otp_phase_duration_quantile_seconds gauge\n");
+  static const double quantiles[] = { 50, 99, 99.9 };
+  for (int p = 0; p < METRIC_PHASES; p++){
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++){
+      append(&out, "otp_phase_duration_quantile_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n", phaseNames[p],
+             quantiles[q] / 100, histogramPercentile(&metrics->phases[p], quantiles[q]) / 1e9);
+    }
+  }
+  return out.length < size ? out.length : size - 1;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// admin endpoint
+
+struct admin {
+  struct serverMetrics *metrics;
+  struct serverTrace *trace;
+  int listenSocket;
+};
+
+static void sendAll(int fd, const char *data, size_t length){
+  while (length > 0){
+    ssize_t charsWritten = send(fd, data, length, MSG_NOSIGNAL);
+    if (charsWritten < 0 && errno == EINTR){
+      continue;
+    }
+    if (charsWritten <= 0){     //gone, or too slow (SO_SNDTIMEO)
+      return;
+    }
+    data += charsWritten;
+    length -= charsWritten;
+  }
+}
+
+// read the request up to the end of its headers, returns its length (0 if it never got that far)
+static size_t readRequest(int fd, char *request, size_t size){
+  size_t filled = 0;
+  while (filled < size - 1){
+    ssize_t charsRead = recv(fd, request + filled, size - 1 - filled, 0);
+    if (charsRead < 0 && errno == EINTR){
+      continue;
+    }
+    if (charsRead <= 0){
+      return 0;
+    }
+    filled += charsRead;
+    request[filled] = '\0';
+    if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL){
+      return filled;
+    }
+  }
+  return 0;
+}
+
+static void answer(int fd, const char *status, const char *contentType, const char *body, size_t length){
+  char header[256];
+  int headerLength = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                              status, contentType, length);
+  sendAll(fd, header, headerLength);
+  sendAll(fd, body, length);
+}
+
+// the trace can be tens of megabytes, it is written as it is made and ends with the connection
+static void answerTrace(struct serverTrace *trace, int fd){
+  int copy = dup(fd);
+  FILE *out = copy < 0 ? NULL : fdopen(copy, "w");
+  if (out == NULL){
+    if (copy >= 0){
+      close(copy);
+    }
+    answer(fd, "500 Internal Server Error", "text/plain", "no memory\n", 10);
+    return;
+  }
+  fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\nConnection: close\r\n\r\n");
+  traceDump(trace, out);
+  fclose(out);
+}
+
+static void serveAdminRequest(struct admin *admin, int fd, char *output){
+  char request[ADMIN_REQUEST_MAX];
+  if (readRequest(fd, request, sizeof(request)) == 0){
+    return;
+  }
+  char method[8], path[256];
+  if (sscanf(request, "%7s %255s", method, path) != 2){
+    answer(fd, "400 Bad Request", "text/plain", "bad request\n", 12);
+    return;
+  }
+  if (strcmp(method, "GET") != 0){
+    answer(fd, "405 Method Not Allowed", "text/plain", "GET only\n", 9);
+    return;
+  }
+  if (strcmp(path, "/metrics") == 0 || strcmp(path, "/") == 0){
+    size_t length = metricsFormat(admin->metrics, output, METRICS_OUTPUT);
+    answer(fd, "200 OK", "text/plain; version=0.0.4", output, length);
+    return;
+  }
+  if (strcmp(path, "/trace") == 0 && admin->trace != NULL){
+    answerTrace(admin->trace, fd);
+    return;
+  }
+  answer(fd, "404 Not Found", "text/plain", "not found\n", 10);
+}
+
+static void *adminMain(void *argument){
+  struct admin *admin = argument;
+  char *output = malloc(METRICS_OUTPUT);
+  if (output == NULL){
+    return NULL;
+  }
+  while (1){
+    int fd = accept(admin->listenSocket, NULL, NULL);
+    if (fd < 0){
+      if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE){
+        if (errno == EMFILE || errno == ENFILE){
+          sleep(1);
+        }
+        continue;
+      }
+      break;
+    }
+    //one scraper at a time, none of them may hold the others up for long
+    struct timeval timeout = { ADMIN_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    serveAdminRequest(admin, fd, output);
+    close(fd);
+  }
+  free(output);
+  return NULL;
+}
+
+int metricsServe(struct serverMetrics *metrics, struct serverTrace *trace, int listenSocket){
+  struct admin *admin = malloc(sizeof(struct admin));
+  if (admin == NULL){
+    return -1;
+  }
+  admin->metrics = metrics;
+  admin->trace = trace;
+  admin->listenSocket = listenSocket;
+  pthread_t thread;
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+  int failed = pthread_create(&thread, &attributes, adminMain, admin);
+  pthread_attr_destroy(&attributes);
+  if (failed){
+    free(admin);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef SERVER_METRICS_H
+#define SERVER_METRICS_H
+
+#include <stdint.h>
+
+#include "histogram.h"
+#include "server_trace.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* What the servers count and time, for capacity planning and alerts. The counters and the
+* latency histograms live in one shared anonymous mapping made before the first fork, so the
+* prefork workers and the fork mode children all add to the same numbers (with atomic adds).
+*
+* The admin endpoint (-a port or socket path) serves them in the Prometheus text format over
+* HTTP: GET /metrics. It runs on a thread of the process that started the server (the prefork
+* master, the fork mode parent), never in the loops that serve the clients. With a trace
+* (server_trace.h) it also serves that: GET /trace.
+*
+* Every function takes a NULL metrics and does nothing then, that is a server without -a.
+*/
+
+enum metricsCounter {
+  METRIC_CONNECTIONS_ACCEPTED,
+  METRIC_CONNECTIONS_REJECTED,    // accepted but dropped: out of descriptors or memory, fork failed
+  METRIC_CONNECTIONS_ACTIVE,      // gauge
+  METRIC_REQUESTS,                // served, streamed ones once
+  METRIC_REQUESTS_REFUSED,        // answered with an error status
+  METRIC_BYTES_IN,
+  METRIC_BYTES_OUT,
+  METRIC_HANDSHAKE_FAILURES,      // wrong test message, magic or protocol version
+  METRIC_SHORT_READS,             // recv returned less than the state expected
+  METRIC_SHORT_WRITES,            // sendmsg took less than was queued
+  METRIC_COUNTERS
+};
+
+// the phases of a request the histograms time
+enum metricsPhase {
+  PHASE_HANDSHAKE,                // accept -> first header (or the old test message answered)
+  PHASE_KEY,                      // receiving the key (of a stream chunk)
+  PHASE_TEXT,                     // receiving the text (of a stream chunk)
+  PHASE_TRANSFORM,
+  PHASE_SEND,                     // result ready -> its last byte handed to the kernel
+  METRIC_PHASES
+};
+
+struct serverMetrics {
+  uint64_t counters[METRIC_COUNTERS];
+  struct histogram phases[METRIC_PHASES];         // nanoseconds
+};
+
+// the shared mapping, NULL if it can't be made
+struct serverMetrics *metricsCreate(void);
+
+// CLOCK_MONOTONIC nanoseconds, 0 without metrics (nothing is timed then)
+uint64_t metricsClock(const struct serverMetrics *metrics);
+
+void metricsAdd(struct serverMetrics *metrics, enum metricsCounter counter, int64_t amount);
+
+// time spent in a phase that started at since (a metricsClock() value)
+void metricsRecordPhase(struct serverMetrics *metrics, enum metricsPhase phase, uint64_t since);
+
+// the metrics in the Prometheus text format, returns the length (truncated to size - 1 like snprintf)
+size_t metricsFormat(const struct serverMetrics *metrics, char *out, size_t size);
+
+// answer HTTP requests on listenSocket from a thread of this process (trace may be NULL), returns -1 if it can't be started
+int metricsServe(struct serverMetrics *metrics, struct serverTrace *trace, int listenSocket);
+
+#endif
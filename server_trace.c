@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>  // __rdtsc()
+#endif
+
+#include "server_trace.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+static const char *eventNames[TRACE_EVENT_TYPES] = { "accept", "handshake", "length", "key", "text", "transform", "send", "close" };
+static const char *argumentNames[TRACE_EVENT_TYPES] = { "fd", "byte", "length", "bytes", "bytes", "chars", "length", "requests" };
+
+static struct traceRing *ownRing;       // the ring of this process
+static uint32_t ownPid;
+
+static uint64_t nowNs(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// a few cycles where there is a time stamp counter, the monotonic clock elsewhere
+static uint64_t traceTicks(void){
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return nowNs();
+#endif
+}
+
+struct serverTrace *traceCreate(void){
+  struct serverTrace *trace = mmap(NULL, sizeof(struct serverTrace), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (trace == MAP_FAILED){
+    return NULL;
+  }
+  //zeroed by the kernel, pages are only taken as the rings fill
+  trace->startTicks = traceTicks();
+  trace->startNs = nowNs();
+  return trace;
+}
+
+void traceAttach(struct serverTrace *trace, int worker){
+  if (trace == NULL){
+    return;
+  }
+  ownPid = (uint32_t) getpid();
+  ownRing = &trace->rings[(worker >= 0 ? (uint32_t) worker : ownPid) % TRACE_RINGS];
+}
+
+void traceRecord(struct serverTrace *trace, enum traceEventType type, uint32_t connection, uint64_t argument){
+  if (trace == NULL){
+    return;
+  }
+  if (ownRing == NULL){
+    traceAttach(trace, -1);
+  }
+  //fork mode children may share a ring, the add gives every writer a slot of its own
+  uint64_t index = __atomic_fetch_add(&ownRing->head, 1, __ATOMIC_RELAXED);
+  struct traceEvent *event = &ownRing->events[index & (TRACE_RING_EVENTS - 1)];
+  __atomic_store_n(&event->sequence, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  event->pid = ownPid;
+  event->time = traceTicks();
+  event->argument = argument;
+  event->connection = connection;
+  event->type = type;
+  __atomic_store_n(&event->sequence, (uint32_t) index + 1, __ATOMIC_RELEASE);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// Chrome trace JSON
+
+// copy the event in slot index of ring if it is still there and not being rewritten
+static int readEvent(const struct traceRing *ring, uint64_t index, struct traceEvent *copy){
+  const struct traceEvent *event = &ring->events[index & (TRACE_RING_EVENTS - 1)];
+  uint32_t sequence = __atomic_load_n(&event->sequence, __ATOMIC_ACQUIRE);
+  if (sequence != (uint32_t) index + 1){
+    return 0;
+  }
+  memcpy(copy, event, sizeof(*copy));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&event->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+// by process, connection and time, so the events of a connection follow each other
+static int compareEvents(const void *a, const void *b){
+  const struct traceEvent *x = a, *y = b;
+  if (x->pid != y->pid){
+    return x->pid < y->pid ? -1 : 1;
+  }
+  if (x->connection != y->connection){
+    return x->connection < y->connection ? -1 : 1;
+  }
+  if (x->time != y->time){
+    return x->time < y->time ? -1 : 1;
+  }
+  return 0;
+}
+
+long traceDump(struct serverTrace *trace, FILE *out){
+  uint64_t heads[TRACE_RINGS];
+  size_t count = 0;
+  for (int r = 0; r < TRACE_RINGS; r++){
+    heads[r] = __atomic_load_n(&trace->rings[r].head, __ATOMIC_ACQUIRE);
+    count += heads[r] < TRACE_RING_EVENTS ? heads[r] : TRACE_RING_EVENTS;
+  }
+  struct traceEvent *events = malloc((count > 0 ? count : 1) * sizeof(struct traceEvent));
+  if (events == NULL){
+    return -1;
+  }
+  //only the slots that were ever written, the untouched rest of the mapping stays unallocated
+  size_t found = 0;
+  for (int r = 0; r < TRACE_RINGS; r++){
+    uint64_t first = heads[r] > TRACE_RING_EVENTS ? heads[r] - TRACE_RING_EVENTS : 0;
+    for (uint64_t i = first; i < heads[r] && found < count; i++){
+      found += readEvent(&trace->rings[r], i, &events[found]);
+    }
+  }
+  qsort(events, found, sizeof(struct traceEvent), compareEvents);
+
+  //ticks to microseconds since the trace was made, from the rate over its whole life
+  double ticksPerUs = 1000.0;
+#if defined(__x86_64__) || defined(__i386__)
+  uint64_t elapsedNs = nowNs() - trace->startNs;
+  if (elapsedNs > 0){
+    ticksPerUs = (double) (traceTicks() - trace->startTicks) / elapsedNs * 1000.0;
+  }
+#endif
+
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  const char *separator = "";
+  for (size_t i = 0; i < found; i++){
+    const struct traceEvent *event = &events[i];
+    double at = ((int64_t) (event->time - trace->startTicks)) / ticksPerUs;
+    int first = i == 0 || event->pid != events[i - 1].pid || event->connection != events[i - 1].connection;
+    if (first){           //name the row
+      fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"connection %u\"}}",
+              separator, event->pid, event->connection, event->connection);
+      separator = ",\n";
+    }
+    if (first){           //nothing before it to measure from
+      fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%u,\"tid\":%u,\"args\":{\"%s\":%llu}}",
+              separator, eventNames[event->type], at, event->pid, event->connection,
+              argumentNames[event->type], (unsigned long long) event->argument);
+    } else {              //the span of the step this event ends
+      double since = ((int64_t) (events[i - 1].time - trace->startTicks)) / ticksPerUs;
+      fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%u,\"args\":{\"%s\":%llu}}",
+              separator, eventNames[event->type], since, at - since, event->pid, event->connection,
+              argumentNames[event->type], (unsigned long long) event->argument);
+    }
+  }
+  fprintf(out, "\n]}\n");
+  free(events);
+  return ferror(out) ? -1 : (long) found;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+// dump on SIGUSR1
+
+struct traceWatch {
+  struct serverTrace *trace;
+  const char *path;
+};
+
+// write it next to the file and rename it over, a reader never sees half a trace
+static void dumpToFile(struct serverTrace *trace, const char *path){
+  char temporary[4096];
+  snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+  FILE *out = fopen(temporary, "w");
+  if (out == NULL){
+    syslog(LOG_ERR, "Can't write the trace to %s (%s)", temporary, strerror(errno));
+    return;
+  }
+  long events = traceDump(trace, out);
+  if (fclose(out) != 0 || events < 0 || rename(temporary, path) < 0){
+    syslog(LOG_ERR, "Can't write the trace to %s", path);
+    unlink(temporary);
+    return;
+  }
+  syslog(LOG_INFO, "Wrote %ld trace events to %s", events, path);
+}
+
+static void *watchMain(void *argument){
+  struct traceWatch *watch = argument;
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  while (1){
+    int signal;
+    if (sigwait(&signals, &signal) == 0){
+      dumpToFile(watch->trace, watch->path);
+    }
+  }
+  return NULL;
+}
+
+int traceWatchSignal(struct serverTrace *trace, const char *path){
+  struct traceWatch *watch = malloc(sizeof(struct traceWatch));
+  if (watch == NULL){
+    return -1;
+  }
+  watch->trace = trace;
+  watch->path = path;
+  //blocked here and in every thread and process started after us, so sigwait() takes it instead of the default action (exit)
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  pthread_t thread;
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+  int failed = pthread_create(&thread, &attributes, watchMain, watch);
+  pthread_attr_destroy(&attributes);
+  if (failed){
+    free(watch);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef SERVER_TRACE_H
+#define SERVER_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* Request lifecycle tracing, for finding out where a slow request spent its time. Every step of
+* a connection (accepted, first byte, length known, key and text in, transformed, sent, closed)
+* is one 32-byte event in a ring: a time stamp counter read, an atomic add on the ring head and
+* four stores, no locks and no system calls. A ring keeps the last TRACE_RING_EVENTS events.
+*
+* The rings live in one shared anonymous mapping made before the first fork. Every process
+* records into its own ring (prefork worker i into ring i, the others by pid), so the process
+* that started the server can read all of them: SIGUSR1 writes them to the trace file (-x),
+* the admin endpoint (-a) serves them at GET /trace. The output is the Chrome trace event JSON
+* that chrome://tracing and Perfetto load: a row per connection, a span per step that ends
+* where the step ends (the "key" span is the time the key took to arrive).
+*
+* Every function takes a NULL trace and does nothing then, that is a server without -x.
+*/
+
+#define TRACE_RINGS 64
+#define TRACE_RING_EVENTS 65536         // a power of two
+
+enum traceEventType {
+  TRACE_ACCEPT,                   // argument: the socket
+  TRACE_HANDSHAKE,                // first byte received, argument: that byte
+  TRACE_LENGTH,                   // a header or length field parsed, argument: the text length
+  TRACE_KEY,                      // key (of a chunk) received, argument: its length
+  TRACE_TEXT,                     // text (of a chunk) received, argument: its length
+  TRACE_TRANSFORM,                // argument: chars transformed
+  TRACE_SENT,                     // last byte of a result handed to the kernel, argument: its text length
+  TRACE_CLOSE,                    // argument: requests served
+  TRACE_EVENT_TYPES
+};
+
+struct traceEvent {
+  uint32_t sequence;              // index in the ring + 1 once written, 0 while being written
+  uint32_t pid;
+  uint64_t time;                  // time stamp counter
+  uint64_t argument;
+  uint32_t connection;            // numbered by each process
+  uint32_t type;
+};
+
+struct traceRing {
+  uint64_t head;                  // events ever recorded into the ring
+  char padding[56];               // keep the head off the first events' cache line
+  struct traceEvent events[TRACE_RING_EVENTS];
+};
+
+struct serverTrace {
+  uint64_t startTicks;            // time stamp counter and monotonic clock when it was made,
+  uint64_t startNs;               // to turn ticks into time at the dump
+  struct traceRing rings[TRACE_RINGS];
+};
+
+// the shared mapping, NULL if it can't be made
+struct serverTrace *traceCreate(void);
+
+// record into ring worker from now on (-1: the ring of this pid), done by the first event otherwise
+void traceAttach(struct serverTrace *trace, int worker);
+
+void traceRecord(struct serverTrace *trace, enum traceEventType type, uint32_t connection, uint64_t argument);
+
+// every event still in the rings as Chrome trace JSON, returns the number of events (-1 on failure)
+long traceDump(struct serverTrace *trace, FILE *out);
+
+// Block SIGUSR1 and start a thread that writes the trace to path whenever it arrives. Call it before
+// any other thread or process is started so they all keep it blocked. Returns -1 if it can't be started.
+int traceWatchSignal(struct serverTrace *trace, const char *path);
+
+#endif
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE             // CPU_SET(), sched_setaffinity()
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "thread_pool.h"
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+#define CACHE_LINE 64
+
+// the task indices [begin, end) a thread still has to do, begin in the high half so both change with one CAS:
+// the owner takes from the front, thieves cut from the back
+struct taskRange {
+  uint64_t range;
+  char padding[CACHE_LINE - sizeof(uint64_t)];      // every range on its own cache line
+};
+
+struct helper {
+  struct threadPool *pool;
+  int index;                      // its range, the caller of threadPoolRun() is 0
+  pthread_t thread;
+};
+
+struct threadPool {
+  int threads;                    // the caller and threads - 1 helpers
+  struct helper *helpers;
+  struct taskRange *ranges;       // one per thread
+  pthread_mutex_t lock;
+  pthread_cond_t wake;            // a job was started (or the pool is stopping)
+  pthread_cond_t finished;        // the last helper is done with the job
+  unsigned long generation;       // jobs started so far
+  int busy;                       // helpers still working on the current job
+  int stop;
+  threadPoolTask task;
+  void *context;
+};
+
+static uint64_t makeRange(uint32_t begin, uint32_t end){
+  return ((uint64_t) begin << 32) | end;
+}
+
+// take the next index from the front of our own range, returns 0 if it is empty
+static int takeOwn(struct taskRange *own, size_t *index){
+  uint64_t range = __atomic_load_n(&own->range, __ATOMIC_ACQUIRE);
+  while ((uint32_t) (range >> 32) < (uint32_t) range){
+    if (__atomic_compare_exchange_n(&own->range, &range, range + ((uint64_t) 1 << 32), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+      *index = range >> 32;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// move the back half of the fullest range into our own (empty) one, returns 0 once there is nothing left anywhere
+static int steal(struct threadPool *pool, int self){
+  while (1){
+    int victim = -1;
+    uint64_t victimRange = 0;
+    uint32_t most = 0;
+    for (int i = 0; i < pool->threads; i++){
+      uint64_t range = __atomic_load_n(&pool->ranges[i].range, __ATOMIC_ACQUIRE);
+      uint32_t begin = range >> 32, end = (uint32_t) range;
+      if (i != self && begin < end && end - begin > most){
+        victim = i;
+        victimRange = range;
+        most = end - begin;
+      }
+    }
+    if (victim < 0){
+      return 0;
+    }
+    uint32_t end = (uint32_t) victimRange;
+    uint32_t half = (most + 1) / 2;
+    if (__atomic_compare_exchange_n(&pool->ranges[victim].range, &victimRange, makeRange(victimRange >> 32, end - half),
+                                    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+      __atomic_store_n(&pool->ranges[self].range, makeRange(end - half, end), __ATOMIC_RELEASE);
+      return 1;
+    }
+  }
+}
+
+// run tasks until there are none left, our own first
+static void work(struct threadPool *pool, int self){
+  size_t index;
+  while (1){
+    if (takeOwn(&pool->ranges[self], &index)){
+      pool->task(pool->context, index);
+    } else if (!steal(pool, self)){
+      return;
+    }
+  }
+}
+
+static void *helperMain(void *argument){
+  struct helper *helper = argument;
+  struct threadPool *pool = helper->pool;
+
+  //a prefork worker is pinned to one core, its helpers shouldn't be
+  cpu_set_t cores;
+  CPU_ZERO(&cores);
+  long configured = sysconf(_SC_NPROCESSORS_CONF);
+  for (long core = 0; core < configured && core < CPU_SETSIZE; core++){
+    CPU_SET(core, &cores);
+  }
+  sched_setaffinity(0, sizeof(cores), &cores);
+
+  unsigned long seen = 0;
+  pthread_mutex_lock(&pool->lock);
+  while (1){
+    while (!pool->stop && pool->generation == seen){
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    if (pool->stop){
+      break;
+    }
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+    work(pool, helper->index);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->busy == 0){
+      pthread_cond_signal(&pool->finished);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+struct threadPool *threadPoolCreate(int threads){
+  struct threadPool *pool = calloc(1, sizeof(struct threadPool));
+  if (pool == NULL){
+    return NULL;
+  }
+  pool->threads = threads > 1 ? threads : 1;
+  pool->helpers = calloc(pool->threads, sizeof(struct helper));
+  if (pool->helpers == NULL || posix_memalign((void**) &pool->ranges, CACHE_LINE, pool->threads * sizeof(struct taskRange)) != 0){
+    free(pool->helpers);
+    free(pool);
+    return NULL;
+  }
+  for (int i = 0; i < pool->threads; i++){
+    pool->ranges[i].range = 0;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+  for (int i = 1; i < pool->threads; i++){
+    pool->helpers[i].pool = pool;
+    pool->helpers[i].index = i;
+    if (pthread_create(&pool->helpers[i].thread, NULL, helperMain, &pool->helpers[i]) != 0){
+      pool->threads = i;          //only join the ones that started
+      threadPoolDestroy(pool);
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+void threadPoolRun(struct threadPool *pool, size_t tasks, threadPoolTask task, void *context){
+  if (pool->threads == 1 || tasks < 2 || tasks > UINT32_MAX){       //nothing to split
+    for (size_t i = 0; i < tasks; i++){
+      task(context, i);
+    }
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->task = task;
+  pool->context = context;
+  for (int i = 0; i < pool->threads; i++){        //equal shares to begin with
+    __atomic_store_n(&pool->ranges[i].range, makeRange(tasks * i / pool->threads, tasks * (i + 1) / pool->threads), __ATOMIC_RELEASE);
+  }
+  pool->busy = pool->threads - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  work(pool, 0);
+
+  //every helper has to leave the job before the ranges (or the context) can be reused
+  pthread_mutex_lock(&pool->lock);
+  while (pool->busy > 0){
+    pthread_cond_wait(&pool->finished, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void threadPoolDestroy(struct threadPool *pool){
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 1; i < pool->threads; i++){
+    pthread_join(pool->helpers[i].thread, NULL);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->finished);
+  free(pool->ranges);
+  free(pool->helpers);
+  free(pool);
+}
@@ -0,0 +1,35 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+
+/*
+ programmed by Artem Kolpakov
+*/
+
+/**
+* Threads that split one large job between them, used to transform very large messages on
+* several cores. A job is a number of independent tasks (task(context, index) for every index).
+* Every thread starts with an equal share of the indices and takes them one by one from the
+* front; a thread that runs out steals half of what is left to the thread with the most work,
+* so a thread that got descheduled doesn't hold up the whole job.
+*
+* The thread calling threadPoolRun() works on the job too and returns once every task is done.
+* A pool belongs to the process that created it (threads don't survive a fork), its threads may
+* run on any core even when the process is pinned to one.
+*/
+
+struct threadPool;
+
+typedef void (*threadPoolTask)(void *context, size_t index);
+
+// a pool where jobs run on `threads` threads (the caller included), NULL if the threads can't be started
+struct threadPool *threadPoolCreate(int threads);
+
+// run task for every index in [0, tasks), returns when all of them are done
+void threadPoolRun(struct threadPool *pool, size_t tasks, threadPoolTask task, void *context);
+
+// stop and join the threads
+void threadPoolDestroy(struct threadPool *pool);
+
+#endif